@@ -5,19 +5,198 @@
 #ifndef PTHTOOLS_H
 #define PTHTOOLS_H
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
 typedef void * (*pthread_func_t)(void *);
 
 struct Func {
 	pthread_func_t func = nullptr;
 	void *args = nullptr;
 	void **ret_ptr = nullptr;
+	// typed closure, run when no raw func is set (see lf::LF::submit)
+	std::function<void()> call = nullptr;
 
 	void operator()() const {
 		if (func) {
 			void *ret = func(args);
 			if (ret_ptr) *ret_ptr = ret;
+		} else if (call) call();
+	}
+};
+
+// monotonic clock in nanoseconds
+inline uint64_t now_ns() {
+	timespec ts{};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// CLOCK_REALTIME deadline ns from now, for pthread timed waits
+inline timespec deadline_after(const uint64_t ns) {
+	timespec ts{};
+	clock_gettime(CLOCK_REALTIME, &ts);
+	const uint64_t total = (uint64_t) ts.tv_nsec + ns;
+	ts.tv_sec += (time_t) (total / 1000000000ull);
+	ts.tv_nsec = (long) (total % 1000000000ull);
+	return ts;
+}
+
+// Lock-free single producer / single consumer ring buffer.
+// push is only called from one thread and pop from one (other) thread.
+template<class T>
+class SpscRing {
+	std::vector<T> slots;
+	const size_t mask;
+	// written by consumer, read by producer
+	alignas(64) std::atomic<size_t> head = 0;
+	// written by producer, read by consumer
+	alignas(64) std::atomic<size_t> tail = 0;
+
+	static size_t roundUp(size_t n) {
+		size_t p = 2;
+		while (p < n) p <<= 1;
+		return p;
+	}
+
+public:
+	// capacity is rounded up to a power of two
+	explicit SpscRing(const size_t capacity) : slots(roundUp(capacity)), mask(slots.size() - 1) {
+	}
+
+	bool tryPush(const T &v) {
+		const size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) > mask) return false;
+		slots[t & mask] = v;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool tryPop(T &v) {
+		const size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) return false;
+		v = slots[h & mask];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// approximate when called from a third thread
+	size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+
+	size_t capacity() const { return slots.size(); }
+};
+
+// Deficit round robin queue: items are queued per flow (e.g. per client) and flows with
+// items take turns. Each turn grants a flow quantum of cost budget, it is served while its
+// head item fits, so a flow of costly items gets proportionally fewer items through and
+// can't hold the others back. Items of a flow keep their order. Not thread safe.
+template<class T>
+class FairQueue {
+	struct Item {
+		T value;
+		double cost;
+		// arrival order over all flows
+		uint64_t seq;
+	};
+
+	struct Flow {
+		std::queue<Item> items;
+		double deficit = 0;
+		// got its quantum this turn
+		bool granted = false;
+	};
+
+	std::unordered_map<uint64_t, Flow> flows;
+	// flows with items, in turn order. the front one's turn is on.
+	std::deque<uint64_t> active;
+	double quantum;
+	size_t count = 0;
+	uint64_t next_seq = 0;
+
+public:
+	explicit FairQueue(const double quantum = 1) : quantum(quantum) {
+	}
+
+	void push(T value, const uint64_t flow = 0, const double cost = 1) {
+		auto &f = flows[flow];
+		if (f.items.empty()) active.push_back(flow);
+		f.items.push({std::move(value), cost, next_seq++});
+		count++;
+	}
+
+	// takes the next item, queue not empty
+	T pop() {
+		for (size_t refused = 0;; refused++) {
+			auto &f = flows[active.front()];
+			if (!f.granted) {
+				f.deficit += quantum;
+				f.granted = true;
+			}
+			if (f.deficit >= f.items.front().cost) {
+				T value = std::move(f.items.front().value);
+				f.deficit -= f.items.front().cost;
+				f.items.pop();
+				count--;
+				// a flow that runs dry gives up its unused budget
+				if (f.items.empty()) {
+					flows.erase(active.front());
+					active.pop_front();
+				}
+				return value;
+			}
+			// turn over, keep the budget for the next one
+			f.granted = false;
+			active.push_back(active.front());
+			active.pop_front();
+
+			// a whole round fit nothing: hand out the rounds it takes for one to fit at once
+			if (refused + 1 == active.size()) {
+				double rounds = INFINITY;
+				for (const auto key: active) {
+					const auto &g = flows[key];
+					rounds = std::min(rounds, std::ceil((g.items.front().cost - g.deficit) / quantum) - 1);
+				}
+				if (rounds > 0)
+					for (const auto key: active) flows[key].deficit += rounds * quantum;
+				refused = -1;
+			}
 		}
 	}
+
+	// the item queued earliest over all flows' heads, queue not empty
+	const T &oldest() const {
+		const Item *oldest = nullptr;
+		for (const auto key: active) {
+			const auto &head = flows.at(key).items.front();
+			if (!oldest || head.seq < oldest->seq) oldest = &head;
+		}
+		return oldest->value;
+	}
+
+	bool empty() const { return count == 0; }
+
+	size_t size() const { return count; }
+
+	// flows with queued items
+	size_t flowCount() const { return active.size(); }
+
+	void setQuantum(const double q) { quantum = q; }
 };
 
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
 #endif //PTHTOOLS_H
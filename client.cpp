@@ -2,11 +2,21 @@
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <getopt.h>
 #include <iostream>
 #include <poll.h>
+#include <random>
+#include <sstream>
+#include <string>
 #include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
 #include "fd_polling.hpp"
+#include "histogram.hpp"
+#include "protocol.hpp"
 
 constexpr auto SERVER_IP = "127.0.0.1";
 constexpr int SERVER_PORT = 9034;
@@ -43,8 +53,10 @@ fd_t connect_to_server(const char *address, const int port) {
 		perror("connect");
 		safe_exit(EXIT_FAILURE);
 	}
+	// requests are small writes, send them without waiting for acks
+	setNoDelay(sock);
 
-	std::cout << "Connected to server on " << SERVER_IP << ":" << SERVER_PORT << "\n";
+	std::cout << "Connected to server on " << address << ":" << port << "\n";
 
 	return sock;
 }
@@ -83,17 +95,371 @@ void *recv_server(const fd_t server_sock_fd) {
 	return nullptr;
 }
 
-int main() {
+
+// Load generator: framed requests (see protocol.hpp) over many connections, either open loop
+// at a target rate or closed loop with a fixed number of requests in flight per connection.
+// A request's latency runs until its FINAL frame.
+namespace load {
+	uint64_t now_ns() {
+		timespec ts{};
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+	// one kind of request in the mix, sent weight times as often as a weight 1 entry
+	struct MixEntry {
+		std::string kind;
+		int vertices = 0, edges = 0;
+		unsigned weight = 1;
+		// request texts, picked at random. graphs are generated up front
+		std::vector<std::string> texts;
+	};
+
+	// graph texts generated per "graph" mix entry
+	constexpr int graph_variants = 8;
+
+	struct Options {
+		const char *address = SERVER_IP;
+		int port = SERVER_PORT;
+		int connections = 4;
+		// requests per second over all connections, 0 for closed loop
+		double rate = 0;
+		// closed loop: requests in flight per connection
+		int concurrency = 1;
+		double duration = 10;
+		std::vector<MixEntry> mix;
+	};
+
+	struct InFlight {
+		// when the request was due, and when it was actually handed to the socket
+		uint64_t intended = 0, sent = 0;
+	};
+
+	struct LoadConnection {
+		bool open = false;
+		std::string out, in;
+		size_t out_offset = 0;
+		uint32_t next_id = 0;
+		std::unordered_map<uint32_t, InFlight> in_flight;
+	};
+
+	Options options;
+	void *load_reactor = nullptr;
+	// by fd
+	std::vector<LoadConnection> connections;
+	std::vector<fd_t> connection_fds;
+	std::mt19937 rng{std::random_device{}()};
+	std::discrete_distribution<size_t> pick_entry;
+
+	// latency from the actual send, and from when the request was due (open loop)
+	hdr::Histogram service_time, response_time;
+	uint64_t sent = 0, completed = 0, busy = 0, errors = 0, lost = 0;
+	bool sending = true;
+	volatile sig_atomic_t interrupted = 0;
+
+	// kind:vertices:edges[:weight] entries separated by commas ; returns false if malformed
+	bool parseMix(const std::string &spec, std::vector<MixEntry> &mix) {
+		std::istringstream in(spec);
+		std::string item;
+		while (std::getline(in, item, ',')) {
+			std::istringstream fields(item);
+			std::string kind, vertices, edges, weight = "1";
+			if (!std::getline(fields, kind, ':') || !std::getline(fields, vertices, ':') ||
+			    !std::getline(fields, edges, ':'))
+				return false;
+			std::getline(fields, weight, ':');
+			MixEntry entry{kind, atoi(vertices.c_str()), atoi(edges.c_str()), (unsigned) atoi(weight.c_str())};
+			if ((kind != "newgraph" && kind != "graph") || entry.vertices < 1 || entry.edges < 0) return false;
+			mix.push_back(entry);
+		}
+		return !mix.empty();
+	}
+
+	// random undirected graph in the server's "graph" command format
+	std::string randomGraphText(const int vertices, const int edges) {
+		std::uniform_int_distribution<int> vertex(0, vertices - 1), weight(1, 10);
+		std::vector<std::string> adjacency(vertices);
+		for (int e = 0; e < edges && vertices > 1; e++) {
+			const int u = vertex(rng);
+			int v = vertex(rng);
+			if (v == u) v = (v + 1) % vertices;
+			adjacency[u] += std::to_string(v) + " " + std::to_string(weight(rng)) + " ";
+		}
+		std::string text = "graph " + std::to_string(vertices) + " 0\n";
+		for (const auto &line: adjacency) text += line + "\n";
+		return text;
+	}
+
+	void prepareMix() {
+		std::vector<double> weights;
+		for (auto &entry: options.mix) {
+			if (entry.kind == "newgraph")
+				entry.texts = {"newgraph " + std::to_string(entry.vertices) + " " + std::to_string(entry.edges) + " 1 10"};
+			else
+				for (int i = 0; i < graph_variants; i++)
+					entry.texts.push_back(randomGraphText(entry.vertices, entry.edges));
+			weights.push_back(entry.weight);
+		}
+		pick_entry = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+	}
+
+	void closeConnection(const fd_t fd) {
+		auto &connection = connections[fd];
+		if (!connection.open) return;
+		reactor::removeFdFromReactor(load_reactor, fd);
+		close(fd);
+		lost += connection.in_flight.size();
+		connection = {};
+	}
+
+	// writes queued requests until the socket is full, the rest waits for writability
+	void flush(const fd_t fd) {
+		auto &connection = connections[fd];
+		while (connection.open && connection.out_offset < connection.out.size()) {
+			const ssize_t n = send(fd, connection.out.data() + connection.out_offset,
+			                       connection.out.size() - connection.out_offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+				perror("send");
+				closeConnection(fd);
+				return;
+			}
+			connection.out_offset += n;
+		}
+		connection.out.clear();
+		connection.out_offset = 0;
+	}
+
+	void issue(const fd_t fd, const uint64_t intended) {
+		auto &connection = connections[fd];
+		if (!connection.open) return;
+		const auto &entry = options.mix[pick_entry(rng)];
+		const auto &text = entry.texts[rng() % entry.texts.size()];
+		const uint32_t id = connection.next_id++;
+		connection.out += proto::encodeFrame(id, 0, text);
+		connection.in_flight[id] = {intended, now_ns()};
+		sent++;
+		flush(fd);
+	}
+
+	void complete(const fd_t fd, const uint32_t id, const uint8_t flags) {
+		auto &connection = connections[fd];
+		const auto it = connection.in_flight.find(id);
+		if (it == connection.in_flight.end()) return;
+		const uint64_t now = now_ns();
+		const InFlight request = it->second;
+		connection.in_flight.erase(it);
+		completed++;
+		// refused (busy) and failed requests are counted, not timed
+		if (flags & proto::BUSY) busy++;
+		else if (flags & proto::ERROR) errors++;
+		else {
+			service_time.record(now - request.sent);
+			response_time.record(now - request.intended);
+		}
+		// closed loop: the answer frees the slot for the next request
+		if (sending && options.rate <= 0) issue(fd, now);
+	}
+
+	void *on_readable(const fd_t fd) {
+		auto &connection = connections[fd];
+		char buff[64 << 10];
+		while (connection.open) {
+			const ssize_t n = recv(fd, buff, sizeof(buff), MSG_DONTWAIT);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			if (n <= 0) {
+				if (n == 0) fprintf(stderr, "server closed connection %d\n", fd);
+				else perror("recv");
+				closeConnection(fd);
+				return nullptr;
+			}
+			connection.in.append(buff, n);
+		}
+
+		// completes every request whose final frame is in
+		size_t pos = 0;
+		proto::FrameHeader header;
+		while (connection.open && connection.in.size() - pos >= proto::header_size) {
+			if (!proto::decodeHeader(connection.in.data() + pos, header)) {
+				fprintf(stderr, "connection %d: bad frame from server\n", fd);
+				closeConnection(fd);
+				return nullptr;
+			}
+			if (connection.in.size() - pos < proto::header_size + header.length) break;
+			pos += proto::header_size + header.length;
+			if (header.flags & proto::FINAL) complete(fd, header.request_id, header.flags);
+		}
+		if (connection.open) connection.in.erase(0, pos);
+		return nullptr;
+	}
+
+	void *on_writable(const fd_t fd) {
+		flush(fd);
+		return nullptr;
+	}
+
+	void on_interrupt(int) { interrupted = 1; }
+
+	size_t inFlight() {
+		size_t n = 0;
+		for (const auto fd: connection_fds) n += connections[fd].in_flight.size();
+		return n;
+	}
+
+	void report(const double elapsed) {
+		printf("\n%d connections, ", (int) connection_fds.size());
+		if (options.rate > 0) printf("open loop at %.1f req/s", options.rate);
+		else printf("closed loop, %d in flight per connection", options.concurrency);
+		printf(", %.2fs\n", elapsed);
+		printf("sent %lu, completed %lu (%lu busy, %lu failed), lost %lu\n", sent, completed, busy, errors, lost);
+		printf("throughput %.1f req/s\n\n", elapsed > 0 ? (completed - busy - errors) / elapsed : 0);
+
+		service_time.print(stdout, "latency from send", 1000, "us");
+		if (options.rate > 0) {
+			// measured from when each request was due, so server stalls that held back later
+			// sends are charged to them too
+			response_time.print(stdout, "latency from schedule (coordinated omission corrected)", 1000, "us");
+		} else {
+			// closed loop can't send while stalled: backfill the samples it would have taken,
+			// one per mean service time
+			const auto interval = (uint64_t) service_time.mean();
+			service_time.corrected(interval).print(
+				stdout, "latency corrected for coordinated omission", 1000, "us");
+		}
+	}
+
+	int run() {
+		prepareMix();
+		signal(SIGINT, on_interrupt);
+		signal(SIGPIPE, SIG_IGN);
+
+		load_reactor = reactor::startReactor();
+		if (load_reactor == nullptr) return 1;
+		for (int i = 0; i < options.connections; i++) {
+			const fd_t fd = connect_to_server(options.address, options.port);
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			if ((size_t) fd >= connections.size()) connections.resize(fd + 1);
+			connections[fd].open = true;
+			connection_fds.push_back(fd);
+			reactor::addFdToReactor(load_reactor, fd, on_readable, on_writable);
+		}
+
+		const uint64_t start = now_ns(), end = start + (uint64_t) (options.duration * 1e9);
+		// waiting for answers once the run is over
+		const uint64_t drain_timeout = 10ull * 1000000000;
+		const double interval = options.rate > 0 ? 1e9 / options.rate : 0;
+		uint64_t scheduled = 0;
+		size_t next_connection = 0;
+
+		if (options.rate <= 0)
+			for (const auto fd: connection_fds)
+				for (int k = 0; k < options.concurrency; k++) issue(fd, start);
+
+		while (!interrupted) {
+			const uint64_t now = now_ns();
+			if (sending && now >= end) sending = false;
+			if (!sending && (inFlight() == 0 || now >= end + drain_timeout)) break;
+
+			int timeout_ms = 100;
+			if (sending && options.rate > 0) {
+				// open loop: send everything due, late sends keep their due time
+				uint64_t due;
+				while ((due = start + (uint64_t) (scheduled * interval)) <= now) {
+					issue(connection_fds[next_connection++ % connection_fds.size()], due);
+					scheduled++;
+				}
+				timeout_ms = (int) ((due - now + 999999) / 1000000);
+			}
+			reactor::pollReactor(load_reactor, timeout_ms);
+		}
+
+		const double elapsed = (double) (std::min(now_ns(), end) - start) / 1e9;
+		// unanswered requests count as lost
+		for (const auto fd: connection_fds) closeConnection(fd);
+		report(elapsed);
+		reactor::stopReactor(load_reactor);
+		return 0;
+	}
+}
+
+
+int main(int argc, char *argv[]) {
+	bool load_mode = false;
+	const option longopts[] = {
+		{"server", required_argument, nullptr, 's'},
+		{"port", required_argument, nullptr, 'p'},
+		{"load", no_argument, nullptr, 'l'},
+		{"connections", required_argument, nullptr, 'n'},
+		{"rate", required_argument, nullptr, 'r'},
+		{"concurrency", required_argument, nullptr, 'k'},
+		{"duration", required_argument, nullptr, 'd'},
+		{"mix", required_argument, nullptr, 'x'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0}
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "s:p:ln:r:k:d:x:h", longopts, nullptr)) != -1) {
+		switch (opt) {
+			case 's':
+				load::options.address = optarg;
+				break;
+			case 'p':
+				load::options.port = atoi(optarg);
+				break;
+			case 'l':
+				load_mode = true;
+				break;
+			case 'n':
+				load::options.connections = std::max(1, atoi(optarg));
+				load_mode = true;
+				break;
+			case 'r':
+				load::options.rate = atof(optarg);
+				load_mode = true;
+				break;
+			case 'k':
+				load::options.concurrency = std::max(1, atoi(optarg));
+				load_mode = true;
+				break;
+			case 'd':
+				load::options.duration = atof(optarg);
+				load_mode = true;
+				break;
+			case 'x':
+				if (!load::parseMix(optarg, load::options.mix)) {
+					std::cerr << "Bad request mix \"" << optarg << "\"." << std::endl;
+					return 1;
+				}
+				load_mode = true;
+				break;
+			case 'h':
+				std::cout << "Usage: " << argv[0] << " [--server <ip>] [--port <n>]" << std::endl
+						<< "  load generator: --load [--connections <n>] [--rate <req/s> | --concurrency <n>]"
+						<< " [--duration <s>] [--mix <kind>:<vertices>:<edges>[:<weight>],...]" << std::endl
+						<< "  kinds are newgraph and graph, e.g. --mix newgraph:50:100:3,graph:200:800" << std::endl;
+				return 0;
+			default:
+				std::cerr << "Unknown option. Use --help for usage." << std::endl;
+				return 1;
+		}
+	}
+
+	if (load_mode) {
+		if (load::options.mix.empty()) load::parseMix("newgraph:50:100", load::options.mix);
+		return load::run();
+	}
+
 	signal(SIGINT, safe_exit);
 
-	server_connection = connect_to_server(SERVER_IP, SERVER_PORT);
+	server_connection = connect_to_server(load::options.address, load::options.port);
 
 	const auto fd_reactor = reactor::startReactor();
 	reactor::addFdToReactor(fd_reactor, server_connection, recv_server);
 	reactor::addFdToReactor(fd_reactor, STDIN_FILENO, read_in);
 
-	while (true) {
+	// the reactor blocks until the server or stdin has something
+	while (true)
 		reactor::pollReactor(fd_reactor);
-		usleep(1000);
-	}
 }
@@ -0,0 +1,195 @@
+//
+// Client connection with a non-blocking buffered writer.
+//
+
+#include "connection.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "logger.hpp"
+
+namespace reactor {
+	Connection::Connection(const fd_t fd, const size_t high_water, const size_t low_water)
+		: fd(fd), high_water(high_water), low_water(std::min(low_water, high_water)) {}
+
+	Connection::~Connection() { pthread_mutex_destroy(&mutex); }
+
+	int Connection::flushLocked() {
+		if (!pinned.empty()) reapZerocopyLocked();
+		while (!out.empty()) {
+			ssize_t written;
+			if (zerocopy && out.front().size() - out_offset >= zerocopy_threshold) {
+				written = sendZerocopyLocked();
+			} else {
+				// gather as much queued output as one writev takes, up to the next zerocopy chunk
+				iovec iov[max_iov];
+				int count = 0;
+				for (auto it = out.begin(); it != out.end() && count < max_iov; ++it, ++count) {
+					if (count > 0 && zerocopy && it->size() >= zerocopy_threshold) break;
+					const auto data = it->data().substr(count == 0 ? out_offset : 0);
+					iov[count] = {(void *) data.data(), data.size()};
+				}
+				written = writev(fd, iov, count);
+				if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) written = 0;
+			}
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				LOGE("connection %d writev: %s", fd, strerror(errno));
+				return -1;
+			}
+			if (written == 0) return 0;
+
+			buffered -= written;
+			while (written > 0) {
+				const size_t left = out.front().size() - out_offset;
+				if ((size_t) written < left) {
+					out_offset += written;
+					break;
+				}
+				written -= (ssize_t) left;
+				out.pop_front();
+				out_offset = 0;
+				front_pinned = false;
+			}
+		}
+		return 0;
+	}
+
+	ssize_t Connection::sendZerocopyLocked() {
+		auto &chunk = out.front();
+		// owned bytes move to the pinned list, the chunk keeps sending from there
+		if (!chunk.fixed.data()) {
+			pinned.push_back({std::move(chunk.owned)});
+			chunk.fixed = pinned.back().bytes;
+			front_pinned = true;
+		}
+
+		const auto data = chunk.data().substr(out_offset);
+		const ssize_t sent = ::send(fd, data.data(), data.size(), MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			// out of pinnable memory, keep going with copies
+			if (errno == ENOBUFS) {
+				zerocopy = false;
+				return 0;
+			}
+			return -1;
+		}
+		// every send that took bytes gets the next sequence number
+		if (front_pinned) pinned.back().last_seq = zc_next_seq;
+		zc_next_seq++;
+		return sent;
+	}
+
+	void Connection::reapZerocopyLocked() {
+		while (true) {
+			char control[128];
+			msghdr msg{};
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+
+			for (auto cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+				if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+				    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+					continue;
+				const auto err = (const sock_extended_err *) CMSG_DATA(cm);
+				// ee_info..ee_data is the range of sends completed
+				if (err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+					zc_done = std::max(zc_done, err->ee_data + 1);
+			}
+		}
+
+		// the kernel is done with these, unless still being sent from
+		while (!pinned.empty() && pinned.front().last_seq < zc_done &&
+		       !(front_pinned && pinned.size() == 1))
+			pinned.pop_front();
+	}
+
+	void Connection::reapZerocopy() {
+		pthread_mutex_lock(&mutex);
+		if (zerocopy || !pinned.empty()) reapZerocopyLocked();
+		pthread_mutex_unlock(&mutex);
+	}
+
+	int Connection::enableZerocopy() {
+		constexpr int yes = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) < 0) return -1;
+		pthread_mutex_lock(&mutex);
+		zerocopy = true;
+		pthread_mutex_unlock(&mutex);
+		return 0;
+	}
+
+	int Connection::send(std::string data) {
+		std::vector<Chunk> chunks;
+		chunks.emplace_back(std::move(data));
+		return send(std::move(chunks));
+	}
+
+	int Connection::send(std::vector<Chunk> chunks) {
+		pthread_mutex_lock(&mutex);
+		if (closed) {
+			pthread_mutex_unlock(&mutex);
+			return -1;
+		}
+		// with output already queued the I/O thread is waiting for the socket, keep order
+		const bool idle = out.empty();
+		for (auto &chunk: chunks) {
+			if (chunk.size() == 0) continue;
+			buffered += chunk.size();
+			out.push_back(std::move(chunk));
+		}
+		const int result = idle ? flushLocked() : 0;
+		if (result < 0) {
+			out.clear();
+			out_offset = buffered = 0;
+			front_pinned = false;
+			closed = true;
+		}
+		pthread_mutex_unlock(&mutex);
+		return result;
+	}
+
+	int Connection::flush() {
+		pthread_mutex_lock(&mutex);
+		const int result = closed ? -1 : flushLocked();
+		pthread_mutex_unlock(&mutex);
+		return result;
+	}
+
+	size_t Connection::pending() const {
+		pthread_mutex_lock(&mutex);
+		const size_t n = buffered;
+		pthread_mutex_unlock(&mutex);
+		return n;
+	}
+
+	void Connection::close(const bool close_fd) {
+		pthread_mutex_lock(&mutex);
+		out.clear();
+		out_offset = buffered = 0;
+		front_pinned = false;
+		closed = true;
+		// closing under the lock keeps senders off a reused fd
+		if (close_fd && fd_open) {
+			::close(fd);
+			fd_open = false;
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+
+	bool Connection::isClosed() const {
+		pthread_mutex_lock(&mutex);
+		const bool c = closed;
+		pthread_mutex_unlock(&mutex);
+		return c;
+	}
+}
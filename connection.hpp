@@ -0,0 +1,136 @@
+//
+// Client connection with a non-blocking buffered writer.
+//
+
+#ifndef CONNECTION_HPP
+#define CONNECTION_HPP
+
+#include <deque>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "fd_polling.hpp"
+
+namespace reactor {
+	// Piece of output: owned bytes, or a view of bytes that outlive the connection
+	// (static headers, separators). Queued as is, a send gathers chunks with one writev.
+	class Chunk {
+		std::string owned;
+		std::string_view fixed;
+
+		Chunk() = default;
+
+		friend class Connection;
+
+	public:
+		Chunk(std::string data) : owned(std::move(data)) {}
+
+		static Chunk view(const std::string_view data) {
+			Chunk chunk;
+			chunk.fixed = data.data() ? data : std::string_view("");
+			return chunk;
+		}
+
+		std::string_view data() const { return fixed.data() ? fixed : std::string_view(owned); }
+
+		size_t size() const { return data().size(); }
+	};
+
+	// Output side of a client connection. Any thread may send: while nothing is queued the
+	// data is written right away, whatever the socket doesn't take is queued and flushed by
+	// the connection's I/O thread once the socket is writable again. Senders never block.
+	class Connection {
+		mutable pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+		// queued output, the front is already sent up to out_offset
+		std::deque<Chunk> out;
+		size_t out_offset = 0;
+		size_t buffered = 0;
+		bool closed = false, fd_open = true;
+		// queued chunks handed to one writev
+		static constexpr int max_iov = 64;
+
+		// MSG_ZEROCOPY sends: the kernel reads the bytes after send returns, so they are kept
+		// until the socket error queue reports the send's sequence number done
+		struct Pinned {
+			std::string bytes;
+			uint32_t last_seq = 0;
+		};
+
+		bool zerocopy = false;
+		std::deque<Pinned> pinned;
+		// the front chunk views the last pinned bytes and is not fully sent yet
+		bool front_pinned = false;
+		uint32_t zc_next_seq = 0, zc_done = 0;
+
+		// writes queued output until the socket is full ; returns -1 on error.
+		int flushLocked();
+
+		// sends the big chunk at the front with MSG_ZEROCOPY ; returns bytes sent, 0 if the socket
+		// is full, -1 on error.
+		ssize_t sendZerocopyLocked();
+
+		void reapZerocopyLocked();
+
+	public:
+		// queued bytes past which the I/O thread stops reading the client,
+		// and below which it resumes
+		static constexpr size_t default_high_water = 1 << 20;
+		static constexpr size_t default_low_water = 256 << 10;
+
+		const fd_t fd;
+		const size_t high_water, low_water;
+		// reading stopped for backpressure, only touched by the I/O thread
+		bool reading_paused = false;
+		// client of a uring proactor, tells it from later clients on the same fd (see proactor::uringGeneration)
+		uint32_t uring_generation = 0;
+
+		explicit Connection(fd_t fd, size_t high_water = default_high_water, size_t low_water = default_low_water);
+
+		~Connection();
+
+		Connection(const Connection &) = delete;
+
+		Connection &operator=(const Connection &) = delete;
+
+		// chunks at least this big go out with MSG_ZEROCOPY, when enabled
+		static constexpr size_t zerocopy_threshold = 64 << 10;
+
+		// queues data for the client ; returns -1 if the connection is closed or failed.
+		int send(std::string data);
+
+		// queues chunks for the client, kept together ; returns -1 if the connection is closed or failed.
+		int send(std::vector<Chunk> chunks);
+
+		// sends big chunks with MSG_ZEROCOPY if the socket supports it ; returns 0 if enabled.
+		int enableZerocopy();
+
+		// releases zerocopy chunks the kernel is done with, called by the I/O thread
+		// when the socket reports an error (completions arrive on the error queue).
+		void reapZerocopy();
+
+		// writes what is queued, called by the I/O thread when the socket is writable ;
+		// returns -1 on error.
+		int flush();
+
+		// queued bytes not yet taken by the socket
+		size_t pending() const;
+
+		// over the high water mark, stop reading until drained
+		bool congested() const { return pending() > high_water; }
+
+		// back under the low water mark
+		bool drained() const { return pending() <= low_water; }
+
+		// drops queued output, later sends fail. close_fd=false if the fd is owned elsewhere.
+		void close(bool close_fd = true);
+
+		bool isClosed() const;
+	};
+
+	typedef std::shared_ptr<Connection> ConnectionRef;
+}
+
+#endif
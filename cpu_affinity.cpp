@@ -0,0 +1,135 @@
+//
+// CPU topology discovery and thread pinning.
+//
+
+#include "cpu_affinity.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <ranges>
+#include <sstream>
+
+namespace cpu {
+	static std::string readSysfs(const std::string &path) {
+		std::ifstream in(path);
+		std::string value;
+		std::getline(in, value);
+		return value;
+	}
+
+	std::vector<int> parseCpuList(const std::string &list) {
+		std::vector<int> cpus;
+		std::istringstream in(list);
+		std::string range;
+		while (std::getline(in, range, ',')) {
+			int first, last;
+			if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2) {
+				for (int c = first; c <= last; c++) cpus.push_back(c);
+			} else if (sscanf(range.c_str(), "%d", &first) == 1)
+				cpus.push_back(first);
+		}
+		return cpus;
+	}
+
+	std::vector<int> usableCpus() {
+		auto online = parseCpuList(readSysfs("/sys/devices/system/cpu/online"));
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+			perror("sched_getaffinity");
+			return online;
+		}
+		std::erase_if(online, [&allowed](const int c) { return !CPU_ISSET(c, &allowed); });
+		return online;
+	}
+
+	// key of the L3 cache (or package) cpu shares with its siblings
+	static std::string cacheKey(const int c) {
+		const std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(c);
+		for (int index = 0; index < 8; index++) {
+			const std::string cache = base + "/cache/index" + std::to_string(index);
+			if (readSysfs(cache + "/level") == "3")
+				return "l3:" + readSysfs(cache + "/shared_cpu_list");
+		}
+		return "pkg:" + readSysfs(base + "/topology/physical_package_id");
+	}
+
+	std::vector<std::vector<int> > cacheGroups() {
+		std::map<std::string, std::vector<int> > groups;
+		for (const int c: usableCpus())
+			groups[cacheKey(c)].push_back(c);
+
+		std::vector<std::vector<int> > result;
+		for (auto &group: groups | std::views::values)
+			result.push_back(std::move(group));
+		// keep groups in cpu order
+		std::ranges::sort(result, {}, [](const std::vector<int> &g) { return g.front(); });
+		return result;
+	}
+
+	cpu_set_t toSet(const std::vector<int> &cpus) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (const int c: cpus) CPU_SET(c, &set);
+		return set;
+	}
+
+	int pinThread(const pthread_t thread, const cpu_set_t &cpus) {
+		if (CPU_COUNT(&cpus) == 0) return 0;
+		if (const int err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus); err != 0) {
+			fprintf(stderr, "pthread_setaffinity_np: error %d\n", err);
+			return -1;
+		}
+		return 0;
+	}
+
+	Placement plan(const std::vector<int> &io_cpus, const int io_threads, const std::vector<int> &stage_widths) {
+		Placement placement;
+		const auto groups = cacheGroups();
+		std::vector<int> ordered;
+		for (const auto &group: groups)
+			ordered.insert(ordered.end(), group.begin(), group.end());
+		if (ordered.empty()) return placement;
+
+		auto io = io_cpus;
+		std::erase_if(io, [&ordered](const int c) { return std::ranges::find(ordered, c) == ordered.end(); });
+		if (io.empty()) {
+			// a cpu per I/O thread, at least half are left for compute
+			const int n = std::min(std::max(1, io_threads), std::max(1, (int) ordered.size() / 2));
+			io.assign(ordered.begin(), ordered.begin() + n);
+		}
+		placement.io = toSet(io);
+
+		auto compute = ordered;
+		if (compute.size() > io.size())
+			std::erase_if(compute, [&io](const int c) { return std::ranges::find(io, c) != io.end(); });
+
+		// stages take a core per worker from the end, workers keep the rest
+		std::vector<int> stage_cpus;
+		for (const int width: stage_widths) {
+			std::vector<int> cores;
+			for (int w = 0; w < width; w++) {
+				cores.push_back(compute[compute.size() - 1 - stage_cpus.size() % compute.size()]);
+				stage_cpus.push_back(cores.back());
+			}
+			placement.stages.push_back(toSet(cores));
+		}
+		auto worker_cpus = compute;
+		if (stage_cpus.size() < compute.size())
+			std::erase_if(worker_cpus, [&stage_cpus](const int c) {
+				return std::ranges::find(stage_cpus, c) != stage_cpus.end();
+			});
+
+		// each worker may float within the cache group of its core
+		for (const auto &group: groups) {
+			std::vector<int> members;
+			for (const int c: group)
+				if (std::ranges::find(worker_cpus, c) != worker_cpus.end()) members.push_back(c);
+			for (size_t i = 0; i < members.size(); i++)
+				placement.workers.push_back(toSet(members));
+		}
+		return placement;
+	}
+}
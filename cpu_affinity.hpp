@@ -0,0 +1,42 @@
+//
+// CPU topology discovery and thread pinning.
+//
+
+#ifndef CPU_AFFINITY_HPP
+#define CPU_AFFINITY_HPP
+
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+namespace cpu {
+	// parses a sysfs style cpu list ("0-3,8,10-11")
+	std::vector<int> parseCpuList(const std::string &list);
+
+	// online cpus this process may run on
+	std::vector<int> usableCpus();
+
+	// usable cpus grouped by shared L3 cache (falls back to package, then one group)
+	std::vector<std::vector<int> > cacheGroups();
+
+	cpu_set_t toSet(const std::vector<int> &cpus);
+
+	// pins thread to cpus ; returns 0 on success.
+	int pinThread(pthread_t thread, const cpu_set_t &cpus);
+
+	// Thread placement for a server: I/O threads on their own cpus,
+	// a core per pipeline stage worker, workers laid out by cache group.
+	struct Placement {
+		cpu_set_t io{};
+		std::vector<cpu_set_t> stages;
+		// one slot per worker, each the cache group set of its core
+		std::vector<cpu_set_t> workers;
+	};
+
+	// io_cpus empty picks the first usable cpus for I/O, one per I/O thread up to half of them.
+	// stage s gets stage_widths[s] cores, its workers share them. 0 for threadless (fused) stages
+	Placement plan(const std::vector<int> &io_cpus, int io_threads, const std::vector<int> &stage_widths);
+}
+
+#endif //CPU_AFFINITY_HPP
@@ -5,12 +5,26 @@
 #include "fd_polling.hpp"
 
 
+#include <cerrno>
+#include <cstring>
 #include <pthread.h>
-#include <poll.h>
 #include <ranges>
+#include <sys/epoll.h>
 #include <unistd.h>
 #include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include "logger.hpp"
+
+int setNoDelay(const fd_t fd) {
+	const int yes = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) != 0) {
+		LOGW("setsockopt TCP_NODELAY on fd %d: %s", fd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
 
 namespace reactor {
 	// routine to run a reactor, sent to pthread_create
@@ -24,8 +38,9 @@ namespace reactor {
 	}
 	*/
 
-	// list of global active reactors
+	// list of global active reactors, reactors start and stop on their own threads
 	std::vector<fd_polling *> reactors;
+	pthread_mutex_t reactors_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 	int fd_polling::start() {
 		/*if (pthread_create(&thread, nullptr, reactor_routine, this) < 0) {
@@ -36,41 +51,68 @@ namespace reactor {
 			perror("pthread_mutex_init");
 			return -1;
 		}*/
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0) {
+			perror("epoll_create1");
+			return -1;
+		}
 		return 0;
 	}
 
-	void fd_polling::react() {
-		// add fds to poll
-		//pthread_mutex_lock(&mutex);
-		std::vector<pollfd> fds;
-		for (const auto &fd: fd_funcs | std::views::keys)
-			fds.push_back({.fd = fd, .events = POLLIN, .revents = POLLIN});
-		//pthread_mutex_unlock(&mutex);
-
-		// poll for in
-		poll(fds.data(), fd_funcs.size(), -1);
-
-		// check for hot fds and fire callbacks
-		//pthread_mutex_lock(&mutex);
-		// clone callbacks in-case func modifies it
-		auto funcs = fd_funcs;
-		for (const auto fd: fds)
-			if (fd.revents & POLLIN && funcs.contains(fd.fd))
-				funcs[fd.fd](fd.fd);
-		//pthread_mutex_unlock(&mutex);
+	void fd_polling::react(const int timeout_ms) {
+		// wait for hot fds
+		epoll_event events[max_events];
+		const int n = epoll_wait(epoll_fd, events, max_events, timeout_ms);
+		if (n < 0) {
+			if (errno != EINTR) LOGE("epoll_wait: %s", strerror(errno));
+			return;
+		}
+
+		// fire callbacks. a callback may remove (or re-add) other fds of this batch,
+		// so the table is re-checked for every event
+		for (int i = 0; i < n; i++) {
+			const auto fd = (fd_t) (events[i].data.u64 & 0xffffffff);
+			const auto generation = (uint32_t) (events[i].data.u64 >> 32);
+			const auto ready = events[i].events;
+			const auto current = [&] {
+				return (size_t) fd < fd_funcs.size() && fd_funcs[fd].func && fd_funcs[fd].generation == generation;
+			};
+			if (!current()) continue;
+			// hangups and errors go to the read callback, its read reports them
+			if (ready & (EPOLLIN | EPOLLHUP | EPOLLERR) || !fd_funcs[fd].write_func)
+				fd_funcs[fd].func(fd);
+			if (ready & EPOLLOUT && current() && fd_funcs[fd].write_func)
+				fd_funcs[fd].write_func(fd);
+		}
 	}
 
-	int fd_polling::addFd(const fd_t fd, const fd_func callback) {
-		//pthread_mutex_lock(&mutex);
-		fd_funcs.insert(std::pair(fd, callback));
-		//pthread_mutex_unlock(&mutex);
+	int fd_polling::addFd(const fd_t fd, const fd_func callback, const fd_func write_callback) {
+		if (fd < 0 || callback == nullptr) return -1;
+		if ((size_t) fd >= fd_funcs.size())
+			fd_funcs.resize(fd + 1);
+		auto &e = fd_funcs[fd];
+		if (e.func != nullptr) return -1; // already registered
+
+		e.generation++;
+		epoll_event ev{};
+		// with a write callback, writability is reported edge triggered (and so is readability)
+		ev.events = write_callback ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN;
+		ev.data.u64 = (uint64_t) e.generation << 32 | (uint32_t) fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl add");
+			return -1;
+		}
+		e.func = callback;
+		e.write_func = write_callback;
 		return 0;
 	}
 
 	int fd_polling::removeFd(const fd_t fd) {
-		//pthread_mutex_lock(&mutex);
-		fd_funcs.erase(fd);
-		//pthread_mutex_unlock(&mutex);
+		if (fd < 0 || (size_t) fd >= fd_funcs.size() || fd_funcs[fd].func == nullptr) return 0;
+		fd_funcs[fd].func = nullptr;
+		fd_funcs[fd].write_func = nullptr;
+		// fails harmlessly if fd was already closed, which drops it from epoll
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
 		return 0;
 	}
 
@@ -87,6 +129,11 @@ namespace reactor {
 			perror("pthread_mutex_destroy");
 			return -1;
 		}*/
+		if (epoll_fd >= 0) {
+			close(epoll_fd);
+			epoll_fd = -1;
+		}
+		fd_funcs.clear();
 		return 0;
 	}
 
@@ -99,21 +146,23 @@ namespace reactor {
 			perror("Failed to start reactor");
 			return nullptr;
 		}
+		pthread_mutex_lock(&reactors_mutex);
 		reactors.emplace_back(reactor);
+		pthread_mutex_unlock(&reactors_mutex);
 		return reactor;
 	}
 
-	void pollReactor(void *reactor) {
+	void pollReactor(void *reactor, const int timeout_ms) {
 		if (reactor == nullptr) return;
-		static_cast<fd_polling *>(reactor)->react();
+		static_cast<fd_polling *>(reactor)->react(timeout_ms);
 	}
 
-	int addFdToReactor(void *reactor, const fd_t fd, const reactorFunc func) {
+	int addFdToReactor(void *reactor, const fd_t fd, const reactorFunc func, const reactorFunc writeFunc) {
 		if (reactor == nullptr) {
 			perror("error adding fd to reactor: reactor is null");
 			return -1;
 		}
-		return static_cast<fd_polling *>(reactor)->addFd(fd, func);
+		return static_cast<fd_polling *>(reactor)->addFd(fd, func, writeFunc);
 	}
 
 	int removeFdFromReactor(void *reactor, const fd_t fd) {
@@ -131,15 +180,20 @@ namespace reactor {
 			perror("Failed to stop reactor");
 			return -1;
 		}
+		pthread_mutex_lock(&reactors_mutex);
 		std::erase(reactors, r);
+		pthread_mutex_unlock(&reactors_mutex);
 		delete r;
 		return 0;
 	}
 
 	void stopAllReactors() {
-		for (const auto reactor: reactors)
+		// stopReactor erases from reactors, walk a copy
+		pthread_mutex_lock(&reactors_mutex);
+		const auto active = reactors;
+		pthread_mutex_unlock(&reactors_mutex);
+		for (const auto reactor: active)
 			stopReactor(reactor);
-		reactors.clear();
 	}
 }
 
@@ -163,7 +217,7 @@ namespace proactor {
 			// wait to accept new clients (cancellation point)
 			const fd_t client_fd = accept(proactor->socket, nullptr, nullptr);
 			if (client_fd < 0) {
-				perror("accept failed");
+				LOGE("accept failed: %s", strerror(errno));
 				if (errno != EINTR) usleep(1000);
 				continue;
 			}
@@ -182,7 +236,7 @@ namespace proactor {
 				delete cr;
 				continue;
 			}
-			printf("started client thread %lu for client fd %d\n", thread, client_fd);
+			LOGI("started client thread %lu for client fd %d", thread, client_fd);
 			// track client thread
 			pthread_mutex_lock(&proactor->client_mutex);
 			proactor->client_threads.push_back(thread);
@@ -190,7 +244,7 @@ namespace proactor {
 		}
 	}
 
-	pthread_t startProactor(const fd_t sock_fd, const proactorFunc threadFunc) {
+	pthread_t startProactor(const fd_t sock_fd, const proactorFunc threadFunc, const cpu_set_t *cpus) {
 		for (const auto &p: proactors_threads | std::views::values)
 			if (p->socket == sock_fd) {
 				perror("proactor already exists for socket");
@@ -200,7 +254,14 @@ namespace proactor {
 		// create proactor accept thread
 		pthread_t accept_thread;
 		auto fdp = new fd_proactor{sock_fd, threadFunc};
-		if (pthread_create(&accept_thread, nullptr, proactor_routine, fdp) != 0) {
+		// client threads inherit the accept thread affinity
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (cpus && CPU_COUNT(cpus) > 0)
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), cpus);
+		const int err = pthread_create(&accept_thread, &attr, proactor_routine, fdp);
+		pthread_attr_destroy(&attr);
+		if (err != 0) {
 			perror("pthread_create failed");
 			delete fdp;
 			return -1;
@@ -5,10 +5,13 @@
 #ifndef FD_POLLING_H
 #define FD_POLLING_H
 
+#include <cstdint>
 #include <cstdio>
 #include <functional>
 #include <map>
 #include <pthread.h>
+#include <sched.h>
+#include <string>
 #include <vector>
 #include <bits/pthreadtypes.h>
 #include <sys/socket.h>
@@ -17,23 +20,38 @@ typedef int fd_t;
 
 typedef void * (*fd_func)(fd_t fd);
 
+// sends small writes right away (TCP_NODELAY) ; returns 0 on success
+int setNoDelay(fd_t fd);
+
 
 namespace reactor {
 	typedef fd_func reactorFunc;
 
 
-	// Reactor struct
+	// Reactor struct. fds are registered once with epoll (level triggered, or edge
+	// triggered when watched for writing), callbacks live in a flat table indexed by fd.
 	class fd_polling {
-		std::map<fd_t, fd_func> fd_funcs;
+		struct entry {
+			fd_func func = nullptr;
+			fd_func write_func = nullptr;
+			// bumped on every add, tells stale events of a reused fd apart
+			uint32_t generation = 0;
+		};
+
+		fd_t epoll_fd = -1;
+		std::vector<entry> fd_funcs;
 		//pthread_t thread{};
 		//pthread_mutex_t mutex{};
 
 	public:
+		// max events handled per wakeup
+		static constexpr int max_events = 64;
+
 		int start();
 
-		void react();
+		void react(int timeout_ms = -1);
 
-		int addFd(fd_t fd, fd_func callback);
+		int addFd(fd_t fd, fd_func callback, fd_func write_callback = nullptr);
 
 		int removeFd(fd_t fd);
 
@@ -49,10 +67,13 @@ namespace reactor {
 	void *startReactor();
 
 	// runs the reactor. polls for hot fds and fires associated callback functions
-	void pollReactor(void *reactor);
+	// waits up to timeout_ms, -1 for no timeout
+	void pollReactor(void *reactor, int timeout_ms = -1);
 
 	// adds fd to Reactor (for reading) ; returns 0 on success.
-	int addFdToReactor(void *reactor, fd_t fd, reactorFunc func);
+	// with writeFunc, fd is also watched for writing, edge triggered: func must read until
+	// EAGAIN, and writeFunc fires each time the socket becomes writable again.
+	int addFdToReactor(void *reactor, fd_t fd, reactorFunc func, reactorFunc writeFunc = nullptr);
 
 	// removes fd from reactor
 	int removeFdFromReactor(void *reactor, fd_t fd);
@@ -83,10 +104,33 @@ namespace proactor {
 	};
 
 	// starts new proactor and returns proactor thread id.
-	pthread_t startProactor(fd_t sock_fd, proactorFunc threadFunc);
+	// if cpus is given, the accept thread and the client threads it spawns are pinned to it.
+	pthread_t startProactor(fd_t sock_fd, proactorFunc threadFunc, const cpu_set_t *cpus = nullptr);
 
 	// stops proactor by thread id
 	int stopProactor(pthread_t t);
+
+
+	// called on the uring proactor thread with data read from a client,
+	// len is 0 once the client hung up (the proactor closes the fd itself).
+	typedef void (*completionFunc)(fd_t fd, const char *data, size_t len);
+
+	// starts a completion based proactor on io_uring: multishot accept on sock_fd,
+	// multishot reads into a provided buffer ring and linked sends.
+	// returns nullptr if io_uring is not available, callers fall back to a reactor.
+	void *startUringProactor(fd_t sock_fd, completionFunc readFunc, const cpu_set_t *cpus = nullptr);
+
+	// the client now on fd, as sendUring expects it. call from the proactor's completionFunc,
+	// later the fd may already belong to another client.
+	uint32_t uringGeneration(fd_t fd);
+
+	// queues data to the client generation of fd accepted by a uring proactor, from any thread.
+	// sends to one fd go out in order, data for a client already gone is dropped.
+	// returns -1 if no uring proactor owns fd.
+	int sendUring(fd_t fd, uint32_t generation, std::string data);
+
+	// stops uring proactor thread and closes the clients it accepted.
+	int stopUringProactor(void *proactor);
 }
 
 #endif
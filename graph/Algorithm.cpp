@@ -0,0 +1,9 @@
+// Algorithm.cpp
+// Default cost estimate shared by algorithms that run in linear time.
+
+#include "Algorithm.h"
+#include "Graph.h"
+
+double Algorithm::estimatedCost(const Graph &g) const {
+	return static_cast<double>(g.numVertices()) + g.numEdges();
+}
@@ -27,6 +27,11 @@ public:
     // descriptive string with the result.  The graph is passed by
     // reference; algorithms should not modify it.
     virtual std::string run(const Graph &g) = 0;
+
+    // Rough number of basic operations run() needs on g, derived from
+    // the asymptotic complexity of the algorithm.  Used by schedulers
+    // to tell cheap requests from heavy ones.  Defaults to O(V + E).
+    virtual double estimatedCost(const Graph &g) const;
 };
 
 using AlgorithmPtr = std::unique_ptr<Algorithm>;
\ No newline at end of file
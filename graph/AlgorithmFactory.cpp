@@ -30,3 +30,7 @@ AlgorithmPtr createAlgorithm(const std::string &name) {
 		return std::make_unique<MaxCliqueAlgorithm>();
 	return nullptr;
 }
+
+std::vector<std::string> availableAlgorithms() {
+	return {"EULER", "MST", "SCC", "MAXFLOW", "MAXCLIQUE"};
+}
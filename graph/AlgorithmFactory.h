@@ -8,8 +8,12 @@
 
 #include "Algorithm.h"
 #include <string>
+#include <vector>
 
 // Create a unique_ptr to an Algorithm based on the provided name.
 // Returns nullptr if no algorithm with the given name is known.  The
 // names are compared case-insensitively.
-AlgorithmPtr createAlgorithm(const std::string &name);
\ No newline at end of file
+AlgorithmPtr createAlgorithm(const std::string &name);
+
+// Names of all algorithms createAlgorithm knows, in a stable order.
+std::vector<std::string> availableAlgorithms();
\ No newline at end of file
@@ -0,0 +1,91 @@
+// BenchResult.cpp
+// Reading and writing graph_bench results.
+
+#include "BenchResult.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+    std::vector<std::string> splitCsv(const std::string &line) {
+        std::vector<std::string> fields;
+        std::istringstream in(line);
+        std::string field;
+        while (std::getline(in, field, ','))
+            fields.push_back(field);
+        return fields;
+    }
+
+    // value of "key": in a line written by writeBenchJson
+    std::string jsonField(const std::string &line, const std::string &key) {
+        auto pos = line.find("\"" + key + "\":");
+        if (pos == std::string::npos) return "";
+        pos = line.find_first_not_of(" \"", pos + key.size() + 3);
+        auto end = line.find_first_of(",\"}", pos);
+        return line.substr(pos, end - pos);
+    }
+}
+
+const char *benchCsvHeader =
+    "algorithm,family,vertices,edges,density,reps,min_ns,median_ns,mean_ns,max_ns,edges_per_sec,peak_rss_kb,cost";
+
+std::string BenchResult::key() const {
+    std::ostringstream out;
+    out << algorithm << "/" << family << "/V=" << vertices << "/d=" << density;
+    return out.str();
+}
+
+void writeBenchCsv(std::ostream &out, const BenchResult &r) {
+    out << r.algorithm << "," << r.family << "," << r.vertices << "," << r.edges << ","
+        << r.density << "," << r.reps << "," << std::fixed
+        << r.minNs << "," << r.medianNs << "," << r.meanNs << "," << r.maxNs << ","
+        << r.edgesPerSec << "," << std::defaultfloat << r.peakRssKb << "," << r.cost << "\n";
+}
+
+void writeBenchJson(std::ostream &out, const BenchResult &r, bool last) {
+    out << "  {\"algorithm\": \"" << r.algorithm << "\", \"family\": \"" << r.family
+        << "\", \"vertices\": " << r.vertices << ", \"edges\": " << r.edges
+        << ", \"density\": " << r.density << ", \"reps\": " << r.reps << std::fixed
+        << ", \"min_ns\": " << r.minNs << ", \"median_ns\": " << r.medianNs
+        << ", \"mean_ns\": " << r.meanNs << ", \"max_ns\": " << r.maxNs
+        << ", \"edges_per_sec\": " << r.edgesPerSec << std::defaultfloat
+        << ", \"peak_rss_kb\": " << r.peakRssKb << ", \"cost\": " << r.cost << "}" << (last ? "\n" : ",\n");
+}
+
+std::map<std::string, BenchResult> readBenchResults(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("cannot open " + path);
+    std::map<std::string, BenchResult> results;
+    std::string line;
+    while (std::getline(in, line)) {
+        BenchResult r;
+        if (line.find("\"algorithm\"") != std::string::npos) {
+            r.algorithm = jsonField(line, "algorithm");
+            r.family = jsonField(line, "family");
+            r.vertices = std::atoi(jsonField(line, "vertices").c_str());
+            r.edges = std::atoi(jsonField(line, "edges").c_str());
+            r.density = std::atof(jsonField(line, "density").c_str());
+            r.medianNs = std::atof(jsonField(line, "median_ns").c_str());
+            r.maxNs = std::atof(jsonField(line, "max_ns").c_str());
+            r.peakRssKb = std::atol(jsonField(line, "peak_rss_kb").c_str());
+            r.cost = std::atof(jsonField(line, "cost").c_str());
+        } else {
+            auto fields = splitCsv(line);
+            if (fields.size() < 12 || fields[0] == "algorithm") continue;
+            r.algorithm = fields[0];
+            r.family = fields[1];
+            r.vertices = std::atoi(fields[2].c_str());
+            r.edges = std::atoi(fields[3].c_str());
+            r.density = std::atof(fields[4].c_str());
+            r.medianNs = std::atof(fields[7].c_str());
+            r.maxNs = std::atof(fields[9].c_str());
+            r.peakRssKb = std::atol(fields[11].c_str());
+            if (fields.size() > 12) r.cost = std::atof(fields[12].c_str());
+        }
+        results[r.key()] = r;
+    }
+    return results;
+}
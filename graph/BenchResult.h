@@ -0,0 +1,40 @@
+// BenchResult.h
+// One timed case of graph_bench: an algorithm run on a generated
+// graph of some family, size and density.  Results are stored as
+// JSON (one object per line) or CSV, and read back by graph_bench's
+// compare mode and by CostModel.
+
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <string>
+
+struct BenchResult {
+    std::string algorithm, family;
+    int vertices = 0, edges = 0;
+    double density = 0;
+    int reps = 0;
+    double minNs = 0, medianNs = 0, meanNs = 0, maxNs = 0;
+    double edgesPerSec = 0;
+    long peakRssKb = 0;
+    // the algorithm's estimatedCost() of the graph, 0 in older files
+    double cost = 0;
+
+    bool directed() const { return family == "directed"; }
+
+    // identifies the same case across runs
+    std::string key() const;
+};
+
+extern const char *benchCsvHeader;
+
+void writeBenchCsv(std::ostream &out, const BenchResult &r);
+
+// One object per line, so results can be read back without a JSON
+// library (see readBenchResults).
+void writeBenchJson(std::ostream &out, const BenchResult &r, bool last);
+
+// Reads results written by graph_bench in JSON or CSV form, by key.
+// Throws std::runtime_error if path can't be opened.
+std::map<std::string, BenchResult> readBenchResults(const std::string &path);
@@ -0,0 +1,77 @@
+// CostModel.cpp
+// Least squares fit of benchmark times against estimated costs.
+
+#include "CostModel.h"
+#include "BenchResult.h"
+#include "Graph.h"
+
+#include <vector>
+
+namespace {
+    struct Sample {
+        double cost, ns, maxNs;
+    };
+
+    // Fits ns = fixed + perCost * cost minimising the relative error,
+    // since samples span orders of magnitude.  Neither coefficient may
+    // go negative.
+    CostModel::Line fit(const std::vector<Sample> &samples) {
+        double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+        for (const auto &s: samples) {
+            double w = 1.0 / (s.ns * s.ns);
+            sw += w;
+            sx += w * s.cost;
+            sy += w * s.ns;
+            sxx += w * s.cost * s.cost;
+            sxy += w * s.cost * s.ns;
+        }
+        CostModel::Line line;
+        double det = sw * sxx - sx * sx;
+        if (samples.size() > 1 && det > 0) {
+            line.nsPerCost = (sw * sxy - sx * sy) / det;
+            line.fixedNs = (sy - line.nsPerCost * sx) / sw;
+        }
+        if (samples.size() < 2 || det <= 0 || line.nsPerCost < 0 || line.fixedNs < 0) {
+            // through the origin
+            line.fixedNs = 0;
+            line.nsPerCost = sxx > 0 ? sxy / sxx : line.nsPerCost;
+        }
+        for (const auto &s: samples) {
+            double predicted = line.fixedNs + line.nsPerCost * s.cost;
+            if (predicted > 0 && s.maxNs > predicted * line.worstRatio)
+                line.worstRatio = s.maxNs / predicted;
+        }
+        return line;
+    }
+}
+
+int CostModel::calibrate(const std::string &path) {
+    std::map<std::pair<std::string, bool>, std::vector<Sample>> samples;
+    for (const auto &[key, r]: readBenchResults(path))
+        if (r.cost > 0 && r.medianNs > 0)
+            samples[{r.algorithm, r.directed()}].push_back({r.cost, r.medianNs, r.maxNs});
+    for (const auto &[key, s]: samples)
+        m_lines[key] = fit(s);
+    return static_cast<int>(samples.size());
+}
+
+CostModel::Line CostModel::line(const std::string &algorithm, bool directed) const {
+    auto it = m_lines.find({algorithm, directed});
+    if (it != m_lines.end()) return it->second;
+    // the other kind of graph is a better guess than nothing
+    it = m_lines.find({algorithm, !directed});
+    return it != m_lines.end() ? it->second : Line();
+}
+
+double CostModel::predictNs(const Algorithm &algorithm, const Graph &g) const {
+    Line l = line(algorithm.name(), g.isDirected());
+    return l.fixedNs + l.nsPerCost * algorithm.estimatedCost(g);
+}
+
+double CostModel::predictWorstNs(const Algorithm &algorithm, const Graph &g) const {
+    return predictNs(algorithm, g) * line(algorithm.name(), g.isDirected()).worstRatio;
+}
+
+bool CostModel::calibrated(const std::string &algorithm) const {
+    return m_lines.count({algorithm, false}) || m_lines.count({algorithm, true});
+}
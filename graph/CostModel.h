@@ -0,0 +1,49 @@
+// CostModel.h
+// Predicts how long an algorithm takes on a graph.  Each algorithm's
+// estimatedCost() already folds in V, E and density; the model maps
+// it to time with a line fitted per algorithm and per directedness:
+//
+//     time_ns = fixedNs + nsPerCost * estimatedCost(graph)
+//
+// Until calibrated with graph_bench results a generic line is used.
+// Each line also keeps how far the slowest run of a case went above it.
+
+#pragma once
+
+#include "Algorithm.h"
+
+#include <map>
+#include <string>
+#include <utility>
+
+class Graph;
+
+class CostModel {
+public:
+    struct Line {
+        double fixedNs = 5000;
+        double nsPerCost = 10;
+        // largest max / predicted time seen in calibration
+        double worstRatio = 1;
+    };
+
+    // Fits the lines to graph_bench output (JSON or CSV) at path.
+    // Cases without a recorded cost are skipped.  Returns the number of
+    // lines fitted; throws std::runtime_error if path can't be read.
+    int calibrate(const std::string &path);
+
+    // Predicted run time in nanoseconds.
+    double predictNs(const Algorithm &algorithm, const Graph &g) const;
+
+    // Predicted time of the slowest run, as the calibration saw them.
+    double predictWorstNs(const Algorithm &algorithm, const Graph &g) const;
+
+    // Whether a line was fitted for algorithm (by name()) on either kind of graph.
+    bool calibrated(const std::string &algorithm) const;
+
+    // The line used for algorithm (by name()) on directed or undirected graphs.
+    Line line(const std::string &algorithm, bool directed) const;
+
+private:
+    std::map<std::pair<std::string, bool>, Line> m_lines;
+};
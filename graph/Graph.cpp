@@ -8,7 +8,6 @@
 
 #include <sstream>
 #include <stdexcept>
-#include <strstream>
 
 Graph::Graph(int vertices, bool directed)
 	: m_vertices(vertices), m_directed(directed), m_adj(vertices) {
@@ -31,6 +30,13 @@ void Graph::addEdge(int u, int v, int weight) {
 	}
 }
 
+int Graph::numEdges() const {
+	int entries = 0;
+	for (const auto &adj: m_adj)
+		entries += static_cast<int>(adj.size());
+	return m_directed ? entries : entries / 2;
+}
+
 Graph Graph::reversed() const {
 	Graph rev(m_vertices, m_directed);
 	if (m_directed) {
@@ -50,7 +56,7 @@ Graph Graph::reversed() const {
 }
 
 std::string to_string(const Graph &g) {
-	std::ostrstream s;
+	std::ostringstream s;
 	s << g.numVertices() << ' ' << g.isDirected() << std::endl;
 	for (int u = 0; u < g.numVertices(); ++u) {
 		for (const auto &[v, w]: g.neighbours(u))
@@ -61,7 +67,7 @@ std::string to_string(const Graph &g) {
 }
 
 std::string to_string_human(const Graph &g) {
-	std::ostrstream s;
+	std::ostringstream s;
 	const auto directed = g.isDirected();
 	s << "n=" << g.numVertices() << ' ' << (!directed ? "un" : "") << "directed" << std::endl;
 	for (int u = 0; u < g.numVertices(); ++u) {
@@ -95,9 +101,11 @@ Graph from_string(const std::string &str) {
 
 	Graph graph(vertices, directed); // assuming constructor Graph(int vertices, bool directed)
 
+	// rest of the header line, then one adjacency line per vertex (empty if it has none)
+	std::string line;
+	std::getline(in, line);
 	for (int u = 0; u < vertices; ++u) {
-		std::string line;
-		if (!std::getline(in >> std::ws, line))
+		if (!std::getline(in, line))
 			throw std::runtime_error("Invalid graph format: missing adjacency list");
 
 		std::istringstream lin(line);
@@ -31,6 +31,10 @@ public:
 	// Return the number of vertices in the graph.
 	int numVertices() const { return m_vertices; }
 
+	// Return the number of edges in the graph.  Undirected edges are
+	// counted once.
+	int numEdges() const;
+
 	// Return true if the graph is directed.
 	bool isDirected() const { return m_directed; }
 
@@ -11,6 +11,7 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <cmath>
 
 std::string MSTAlgorithm::run(const Graph &g) {
     if (g.isDirected()) {
@@ -60,4 +61,10 @@ std::string MSTAlgorithm::run(const Graph &g) {
     std::ostringstream oss;
     oss << "MST total weight: " << totalWeight;
     return oss.str();
-}
\ No newline at end of file
+}
+
+double MSTAlgorithm::estimatedCost(const Graph &g) const {
+    double n = g.numVertices();
+    double m = g.numEdges();
+    return n + m * std::log2(n + 2);
+}
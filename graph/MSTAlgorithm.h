@@ -12,4 +12,6 @@ class MSTAlgorithm : public Algorithm {
 public:
     std::string name() const override { return "MST"; }
     std::string run(const Graph &g) override;
+    // O(E log V) for Prim's algorithm with a binary heap.
+    double estimatedCost(const Graph &g) const override;
 };
\ No newline at end of file
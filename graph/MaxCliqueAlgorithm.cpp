@@ -9,6 +9,8 @@
 #include <set>
 #include <string>
 #include <sstream>
+#include <algorithm>
+#include <cmath>
 
 namespace {
 
@@ -111,4 +113,13 @@ std::string MaxCliqueAlgorithm::run(const Graph &g) {
         oss << ")";
     }
     return oss.str();
-}
\ No newline at end of file
+}
+
+double MaxCliqueAlgorithm::estimatedCost(const Graph &g) const {
+    double n = g.numVertices();
+    if (n < 2) return n;
+    double density = std::min(1.0, 2.0 * g.numEdges() / (n * (n - 1)));
+    // Capped to keep the estimate finite for huge dense graphs
+    double branching = std::pow(3.0, std::min(n * density / 3.0, 200.0));
+    return n * n + branching;
+}
@@ -10,4 +10,7 @@ class MaxCliqueAlgorithm : public Algorithm {
 public:
     std::string name() const override { return "MAXCLIQUE"; }
     std::string run(const Graph &g) override;
+    // O(V^2) to build the adjacency matrix plus the 3^(V/3) worst case
+    // of Bron–Kerbosch, scaled down by the edge density.
+    double estimatedCost(const Graph &g) const override;
 };
\ No newline at end of file
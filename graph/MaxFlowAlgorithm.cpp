@@ -74,4 +74,11 @@ std::string MaxFlowAlgorithm::run(const Graph &g) {
     std::ostringstream oss;
     oss << "Max flow from 0 to " << sink << ": " << maxFlow;
     return oss.str();
-}
\ No newline at end of file
+}
+
+double MaxFlowAlgorithm::estimatedCost(const Graph &g) const {
+    double n = g.numVertices();
+    double m = g.numEdges();
+    double paths = n > 0 ? 1 + m / n : 1;
+    return n * n * paths;
+}
@@ -13,4 +13,7 @@ class MaxFlowAlgorithm : public Algorithm {
 public:
     std::string name() const override { return "MAXFLOW"; }
     std::string run(const Graph &g) override;
+    // One O(V^2) matrix BFS per augmenting path, with the number of
+    // paths approximated by the average degree.
+    double estimatedCost(const Graph &g) const override;
 };
\ No newline at end of file
@@ -0,0 +1,345 @@
+// graph_bench.cpp
+// Benchmark suite for the graph algorithms.  Sweeps every algorithm
+// known to the factory across generator families, sizes and
+// densities, timing warmed up repetitions of run().  Results are
+// printed as a table, JSON or CSV; compare mode reads two result
+// files and flags the cases that got slower.
+
+#include "AlgorithmFactory.h"
+#include "BenchResult.h"
+#include "Graph.h"
+#include "RandomGraph.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+namespace {
+    // Graph families to sweep.  density is the fraction of possible
+    // edges present; the grid family has a fixed shape and ignores it.
+    const std::vector<std::string> allFamilies = {"random", "directed", "cycle", "grid"};
+
+    std::vector<std::string> split(const std::string &list) {
+        std::vector<std::string> items;
+        std::istringstream in(list);
+        std::string item;
+        while (std::getline(in, item, ','))
+            if (!item.empty()) items.push_back(item);
+        return items;
+    }
+
+    long long maxEdges(int vertices, bool directed) {
+        long long n = vertices;
+        return directed ? n * (n - 1) : n * (n - 1) / 2;
+    }
+
+    // Ring through all vertices plus random chords up to the density.
+    // Every vertex has even degree before the chords, so sparse cycles
+    // exercise the Euler circuit path.
+    Graph cycleGraph(int vertices, double density, unsigned int seed) {
+        Graph g(vertices, false);
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<int> weightDist(1, 10);
+        for (int u = 0; u < vertices && vertices > 2; ++u)
+            g.addEdge(u, (u + 1) % vertices, weightDist(rng));
+        long long chords = static_cast<long long>(density * maxEdges(vertices, false)) - vertices;
+        std::uniform_int_distribution<int> vertexDist(0, std::max(0, vertices - 1));
+        for (long long i = 0; i < chords && vertices > 3; ++i) {
+            int u = vertexDist(rng), v = vertexDist(rng);
+            if (u != v) g.addEdge(u, v, weightDist(rng));
+        }
+        return g;
+    }
+
+    // Square lattice with side floor(sqrt(vertices)).
+    Graph gridGraph(int vertices, unsigned int seed) {
+        int side = std::max(1, static_cast<int>(std::sqrt(static_cast<double>(vertices))));
+        Graph g(side * side, false);
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<int> weightDist(1, 10);
+        for (int r = 0; r < side; ++r)
+            for (int c = 0; c < side; ++c) {
+                int u = r * side + c;
+                if (c + 1 < side) g.addEdge(u, u + 1, weightDist(rng));
+                if (r + 1 < side) g.addEdge(u, u + side, weightDist(rng));
+            }
+        return g;
+    }
+
+    Graph generate(const std::string &family, int vertices, double density, unsigned int seed) {
+        if (family == "cycle") return cycleGraph(vertices, density, seed);
+        if (family == "grid") return gridGraph(vertices, seed);
+        bool directed = family == "directed";
+        auto edges = static_cast<int>(std::min<long long>(maxEdges(vertices, directed),
+                                                          std::llround(density * maxEdges(vertices, directed))));
+        return generateRandomGraph(vertices, edges, directed, 1, 10, seed);
+    }
+
+    // Peak resident set size in KiB since the last reset.  Linux lets
+    // a process reset its own high water mark through clear_refs; where
+    // that fails this is the peak of the whole run.
+    void resetPeakRss() {
+        std::ofstream clear("/proc/self/clear_refs");
+        if (clear) clear << "5";
+    }
+
+    long peakRssKb() {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+            if (line.rfind("VmHWM:", 0) == 0) return std::atol(line.c_str() + 6);
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    // written with the results' sizes so run() can't be optimised away
+    volatile size_t resultSink;
+
+    BenchResult measure(const std::string &algName, const std::string &family, const Graph &g,
+                   double density, int warmups, int reps) {
+        auto alg = createAlgorithm(algName);
+        size_t sink = 0;
+        for (int i = 0; i < warmups; ++i) sink += alg->run(g).size();
+
+        resetPeakRss();
+        std::vector<double> times;
+        for (int i = 0; i < reps; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            sink += alg->run(g).size();
+            auto end = std::chrono::steady_clock::now();
+            times.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+        }
+        std::sort(times.begin(), times.end());
+
+        BenchResult r;
+        r.algorithm = alg->name();
+        r.family = family;
+        r.vertices = g.numVertices();
+        r.edges = g.numEdges();
+        r.density = density;
+        r.reps = reps;
+        r.minNs = times.front();
+        r.maxNs = times.back();
+        r.medianNs = times[times.size() / 2];
+        for (double t: times) r.meanNs += t / times.size();
+        r.edgesPerSec = r.medianNs > 0 ? r.edges / (r.medianNs / 1e9) : 0;
+        r.peakRssKb = peakRssKb();
+        r.cost = alg->estimatedCost(g);
+        resultSink = sink;
+        return r;
+    }
+
+    void writeText(std::ostream &out, const BenchResult &r) {
+        char line[256];
+        std::snprintf(line, sizeof(line), "%-10s %-9s %7d %9d %7.4f %12.3f %12.3f %14.0f %9ld\n",
+                      r.algorithm.c_str(), r.family.c_str(), r.vertices, r.edges, r.density,
+                      r.medianNs / 1e6, r.minNs / 1e6, r.edgesPerSec, r.peakRssKb);
+        out << line;
+    }
+
+    // Differences below this are timer noise, never flagged.
+    constexpr double noiseFloorNs = 10000;
+
+    // Prints every case of current whose median time grew more than
+    // threshold percent over baseline.  Returns the number of them.
+    int compare(const std::string &baselinePath, const std::string &currentPath, double threshold) {
+        auto baseline = readBenchResults(baselinePath);
+        auto current = readBenchResults(currentPath);
+        int regressions = 0, matched = 0;
+        for (const auto &[key, now]: current) {
+            auto it = baseline.find(key);
+            if (it == baseline.end() || it->second.medianNs <= 0) continue;
+            ++matched;
+            double change = 100.0 * (now.medianNs - it->second.medianNs) / it->second.medianNs;
+            bool significant = std::abs(now.medianNs - it->second.medianNs) >= noiseFloorNs;
+            bool regressed = significant && change > threshold;
+            if (regressed) ++regressions;
+            char line[256];
+            std::snprintf(line, sizeof(line), "%-4s %-40s %12.3f ms -> %12.3f ms  %+7.1f%%\n",
+                          regressed ? "SLOW" : (significant && change < -threshold ? "FAST" : "ok"), key.c_str(),
+                          it->second.medianNs / 1e6, now.medianNs / 1e6, change);
+            std::cout << line;
+        }
+        std::cout << matched << " cases compared, " << regressions << " regressed by more than "
+                  << threshold << "%" << std::endl;
+        return regressions;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> algorithms = availableAlgorithms();
+    std::vector<std::string> families = allFamilies;
+    std::vector<int> sizes = {64, 256, 1024};
+    std::vector<double> densities = {0.01, 0.1};
+    int warmups = 1;
+    int reps = 5;
+    unsigned int seed = 1;
+    // cases the algorithm itself estimates above this are skipped
+    double maxCost = 1e9;
+    std::string format = "text";
+    std::string outputPath;
+    double threshold = 10;
+    std::vector<std::string> comparePaths;
+    const struct option longopts[] = {
+        {"algorithms", required_argument, nullptr, 'a'},
+        {"families", required_argument, nullptr, 'f'},
+        {"sizes", required_argument, nullptr, 'v'},
+        {"densities", required_argument, nullptr, 'd'},
+        {"warmup", required_argument, nullptr, 'w'},
+        {"reps", required_argument, nullptr, 'r'},
+        {"seed", required_argument, nullptr, 's'},
+        {"max-cost", required_argument, nullptr, 'c'},
+        {"format", required_argument, nullptr, 'F'},
+        {"output", required_argument, nullptr, 'o'},
+        {"compare", no_argument, nullptr, 'C'},
+        {"threshold", required_argument, nullptr, 't'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    bool compareMode = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:f:v:d:w:r:s:c:F:o:Ct:h", longopts, nullptr)) != -1) {
+        switch (opt) {
+        case 'a':
+            algorithms = split(optarg);
+            break;
+        case 'f':
+            families = split(optarg);
+            break;
+        case 'v':
+            sizes.clear();
+            for (const auto &s: split(optarg)) sizes.push_back(std::atoi(s.c_str()));
+            break;
+        case 'd':
+            densities.clear();
+            for (const auto &s: split(optarg)) densities.push_back(std::atof(s.c_str()));
+            break;
+        case 'w':
+            warmups = std::max(0, std::atoi(optarg));
+            break;
+        case 'r':
+            reps = std::max(1, std::atoi(optarg));
+            break;
+        case 's':
+            seed = static_cast<unsigned int>(std::strtoul(optarg, nullptr, 10));
+            break;
+        case 'c':
+            maxCost = std::atof(optarg);
+            break;
+        case 'F':
+            format = optarg;
+            break;
+        case 'o':
+            outputPath = optarg;
+            break;
+        case 'C':
+            compareMode = true;
+            break;
+        case 't':
+            threshold = std::atof(optarg);
+            break;
+        case 'h':
+            std::cout << "Usage: " << argv[0]
+                      << " [--algorithms <a,b>] [--families <f,g>] [--sizes <n,m>] [--densities <x,y>]"
+                      << " [--warmup <n>] [--reps <n>] [--seed <s>] [--max-cost <ops>]"
+                      << " [--format text|json|csv] [--output <file>]" << std::endl
+                      << "       " << argv[0] << " --compare [--threshold <percent>] <baseline> <current>"
+                      << std::endl
+                      << "families: random, directed, cycle, grid" << std::endl;
+            return 0;
+        default:
+            std::cerr << "Unknown option. Use --help for usage." << std::endl;
+            return 1;
+        }
+    }
+
+    if (compareMode) {
+        for (int i = optind; i < argc; ++i) comparePaths.push_back(argv[i]);
+        if (comparePaths.size() != 2) {
+            std::cerr << "Compare mode takes a baseline and a current result file." << std::endl;
+            return 1;
+        }
+        try {
+            return compare(comparePaths[0], comparePaths[1], threshold) > 0 ? 2 : 0;
+        } catch (const std::exception &ex) {
+            std::cerr << ex.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (format != "text" && format != "json" && format != "csv") {
+        std::cerr << "Unknown format: " << format << std::endl;
+        return 1;
+    }
+    for (const auto &name: algorithms)
+        if (!createAlgorithm(name)) {
+            std::cerr << "Unknown algorithm: " << name << std::endl;
+            return 1;
+        }
+    for (const auto &family: families)
+        if (std::find(allFamilies.begin(), allFamilies.end(), family) == allFamilies.end()) {
+            std::cerr << "Unknown family: " << family << std::endl;
+            return 1;
+        }
+
+    std::ofstream file;
+    if (!outputPath.empty()) {
+        file.open(outputPath);
+        if (!file) {
+            std::cerr << "Cannot write " << outputPath << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &out = outputPath.empty() ? std::cout : file;
+
+    std::vector<BenchResult> results;
+    if (format == "text")
+        out << "algorithm  family    vertices     edges density    median_ms       min_ms        edges/s    rss_kb\n";
+    for (const auto &family: families)
+        for (int vertices: sizes)
+            for (double density: densities) {
+                // the grid shape doesn't depend on density
+                if (family == "grid" && density != densities.front()) continue;
+                Graph g;
+                try {
+                    g = generate(family, vertices, density, seed);
+                } catch (const std::exception &ex) {
+                    std::cerr << "skipping " << family << " V=" << vertices << ": " << ex.what() << std::endl;
+                    continue;
+                }
+                for (const auto &name: algorithms) {
+                    double cost = createAlgorithm(name)->estimatedCost(g);
+                    if (cost > maxCost) {
+                        std::cerr << "skipping " << name << " on " << family << " V=" << vertices
+                                  << " d=" << density << ": estimated cost " << cost << std::endl;
+                        continue;
+                    }
+                    results.push_back(measure(name, family, g, density, warmups, reps));
+                    if (format == "text") writeText(out, results.back());
+                    // progress goes to stderr so the output stays parseable
+                    else std::cerr << results.back().key() << std::endl;
+                }
+            }
+
+    if (format == "csv") {
+        out << benchCsvHeader << "\n";
+        for (const auto &r: results) writeBenchCsv(out, r);
+    } else if (format == "json") {
+        out << "[\n";
+        for (size_t i = 0; i < results.size(); ++i) writeBenchJson(out, results[i], i + 1 == results.size());
+        out << "]\n";
+    }
+    return 0;
+}
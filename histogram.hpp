@@ -0,0 +1,120 @@
+//
+// Latency histogram with bounded relative error, in the spirit of HdrHistogram.
+//
+
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace hdr {
+	// Log-linear buckets: values below 2^sub_bits are counted exactly, above that every
+	// power of two range is split in 2^(sub_bits - 1) equal buckets, so a recorded value is
+	// known to within 1 / 2^(sub_bits - 1) of itself (under 1% with sub_bits = 8).
+	// Not synchronized, keep one per thread and merge them.
+	class Histogram {
+		static constexpr int sub_bits = 8;
+		static constexpr uint64_t sub_count = 1 << sub_bits, half_count = sub_count / 2;
+		static constexpr size_t bucket_count = sub_count + (64 - sub_bits) * half_count;
+
+		std::vector<uint64_t> counts = std::vector<uint64_t>(bucket_count);
+		uint64_t total = 0, min_value = UINT64_MAX, max_value = 0;
+		// sum of recorded values, for the mean
+		long double sum = 0;
+
+		static size_t index(const uint64_t value) {
+			if (value < sub_count) return value;
+			const int msb = 63 - std::countl_zero(value);
+			const int shift = msb - sub_bits + 1;
+			return sub_count + (msb - sub_bits) * half_count + ((value >> shift) - half_count);
+		}
+
+		// smallest value counted in bucket i
+		static uint64_t lowest(const size_t i) {
+			if (i < sub_count) return i;
+			const size_t range = (i - sub_count) / half_count, sub = (i - sub_count) % half_count;
+			return (half_count + sub) << (range + 1);
+		}
+
+		// largest value counted in bucket i
+		static uint64_t highest(const size_t i) {
+			if (i < sub_count) return i;
+			return lowest(i) + ((uint64_t) 1 << ((i - sub_count) / half_count + 1)) - 1;
+		}
+
+	public:
+		void record(const uint64_t value, const uint64_t count = 1) {
+			if (count == 0) return;
+			counts[index(value)] += count;
+			total += count;
+			min_value = std::min(min_value, value);
+			max_value = std::max(max_value, value);
+			sum += (long double) value * count;
+		}
+
+		// records value, plus the samples a stalled closed loop tester never took: one every
+		// expected_interval below value (coordinated omission correction).
+		void recordCorrected(const uint64_t value, const uint64_t expected_interval, const uint64_t count = 1) {
+			record(value, count);
+			if (expected_interval == 0) return;
+			for (uint64_t missing = value; missing > expected_interval;) {
+				missing -= expected_interval;
+				record(missing, count);
+			}
+		}
+
+		// copy of this histogram with every value recorded through recordCorrected
+		Histogram corrected(const uint64_t expected_interval) const {
+			Histogram out;
+			for (size_t i = 0; i < bucket_count; i++)
+				if (counts[i]) out.recordCorrected(std::min(highest(i), max_value), expected_interval, counts[i]);
+			return out;
+		}
+
+		void merge(const Histogram &other) {
+			for (size_t i = 0; i < bucket_count; i++) counts[i] += other.counts[i];
+			total += other.total;
+			min_value = std::min(min_value, other.min_value);
+			max_value = std::max(max_value, other.max_value);
+			sum += other.sum;
+		}
+
+		void reset() { *this = Histogram(); }
+
+		uint64_t count() const { return total; }
+
+		uint64_t min() const { return total ? min_value : 0; }
+
+		uint64_t max() const { return max_value; }
+
+		double mean() const { return total ? (double) (sum / total) : 0; }
+
+		// value at or below which percentile % of the samples fall, 0 if empty
+		uint64_t percentile(const double percentile) const {
+			if (total == 0) return 0;
+			const auto rank = (uint64_t) std::max(1.0, std::ceil(percentile / 100.0 * (double) total));
+			uint64_t seen = 0;
+			for (size_t i = 0; i < bucket_count; i++) {
+				seen += counts[i];
+				if (seen >= rank) return std::min(highest(i), max_value);
+			}
+			return max_value;
+		}
+
+		// prints count, mean and the usual percentiles, values divided by scale (e.g. 1000 for
+		// microseconds recorded as nanoseconds)
+		void print(FILE *out, const char *title, const double scale = 1, const char *unit = "") const {
+			fprintf(out, "%s: %lu samples, mean %.1f%s, min %.1f%s, max %.1f%s\n", title, total,
+			        mean() / scale, unit, min() / scale, unit, max() / scale, unit);
+			for (const double p: {50.0, 90.0, 99.0, 99.9})
+				fprintf(out, "\tp%-5g %10.1f%s\n", p, percentile(p) / scale, unit);
+		}
+	};
+}
+
+#endif
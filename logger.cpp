@@ -0,0 +1,225 @@
+//
+// Asynchronous logger: records go to per-thread lock-free rings, a flusher thread writes them out.
+//
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <ctime>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/syscall.h>
+
+#include "PthTools.hpp"
+#include "stats.hpp"
+
+namespace logging {
+	namespace {
+		constexpr size_t text_size = 240;
+		// records per thread before logging drops
+		constexpr size_t ring_slots = 1024;
+		constexpr uint64_t flush_interval_ns = 5000000;
+
+		// what the logging thread stores, formatted to text by the flusher
+		struct Record {
+			uint64_t ns;
+			Level level;
+			uint32_t len;
+			char text[text_size];
+		};
+
+		struct ThreadLog {
+			SpscRing<Record> ring = SpscRing<Record>(ring_slots);
+			// owner gone, freed by the flusher once drained
+			std::atomic<bool> exited = false;
+			long tid = 0;
+			char thread_name[16] = "";
+		};
+
+		struct Logger {
+			pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+			pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+			std::vector<ThreadLog *> logs;
+			FILE *out = stdout;
+			std::atomic<bool> running = false;
+			bool stopping = false;
+			pthread_t flusher{};
+			std::atomic<uint64_t> dropped = 0;
+			uint64_t reported_dropped = 0;
+			// CLOCK_REALTIME - CLOCK_MONOTONIC, turns record stamps into wall time
+			int64_t wall_offset_ns = 0;
+		};
+
+		// never destroyed, threads may still log while the process exits
+		Logger &logger() {
+			static auto *l = new Logger();
+			return *l;
+		}
+
+		const int dropped_counter = stats::counter("log.dropped");
+
+		struct ThreadSlot {
+			ThreadLog *log = nullptr;
+
+			ThreadLog &get() {
+				if (log) return *log;
+				log = new ThreadLog();
+				log->tid = syscall(SYS_gettid);
+				pthread_getname_np(pthread_self(), log->thread_name, sizeof(log->thread_name));
+				auto &l = logger();
+				pthread_mutex_lock(&l.mutex);
+				l.logs.push_back(log);
+				pthread_mutex_unlock(&l.mutex);
+				return *log;
+			}
+
+			~ThreadSlot() { if (log) log->exited = true; }
+		};
+
+		thread_local ThreadSlot slot;
+
+		int64_t wallOffset() {
+			timespec wall{};
+			clock_gettime(CLOCK_REALTIME, &wall);
+			return (int64_t) wall.tv_sec * 1000000000ll + wall.tv_nsec - (int64_t) now_ns();
+		}
+
+		const char *levelName(const Level level) {
+			switch (level) {
+				case Level::Debug: return "DEBUG";
+				case Level::Info: return "INFO";
+				case Level::Warn: return "WARN";
+				default: return "ERROR";
+			}
+		}
+
+		// one line: wall time, level, thread, message
+		void print(FILE *out, const Record &r, const char *thread_name, const long tid, const int64_t offset) {
+			const int64_t wall = (int64_t) r.ns + offset;
+			const time_t secs = wall / 1000000000ll;
+			tm local{};
+			localtime_r(&secs, &local);
+			char stamp[32];
+			strftime(stamp, sizeof(stamp), "%H:%M:%S", &local);
+			uint32_t len = r.len;
+			while (len > 0 && r.text[len - 1] == '\n') len--;
+			fprintf(out, "%s.%06ld %-5s %s[%ld] %.*s\n", stamp, (long) (wall % 1000000000ll / 1000),
+			        levelName(r.level), thread_name, tid, (int) len, r.text);
+		}
+
+		struct Entry {
+			const ThreadLog *log;
+			Record record;
+		};
+
+		// writes out what every thread logged so far, oldest first
+		void flush(Logger &l, std::vector<Entry> &batch) {
+			pthread_mutex_lock(&l.mutex);
+			const auto logs = l.logs;
+			pthread_mutex_unlock(&l.mutex);
+
+			batch.clear();
+			std::vector<ThreadLog *> finished;
+			for (const auto log: logs) {
+				// exit seen before draining, nothing can follow
+				const bool exited = log->exited;
+				Entry e{log, {}};
+				while (log->ring.tryPop(e.record)) batch.push_back(e);
+				if (exited) finished.push_back(log);
+			}
+			std::stable_sort(batch.begin(), batch.end(),
+			                 [](const Entry &a, const Entry &b) { return a.record.ns < b.record.ns; });
+			for (const auto &e: batch)
+				print(l.out, e.record, e.log->thread_name, e.log->tid, l.wall_offset_ns);
+
+			const uint64_t dropped = l.dropped;
+			if (dropped > l.reported_dropped) {
+				fprintf(l.out, "logger: %lu records dropped\n", dropped - l.reported_dropped);
+				l.reported_dropped = dropped;
+			}
+			if (!batch.empty()) fflush(l.out);
+
+			if (finished.empty()) return;
+			pthread_mutex_lock(&l.mutex);
+			for (const auto log: finished) {
+				std::erase(l.logs, log);
+				delete log;
+			}
+			pthread_mutex_unlock(&l.mutex);
+		}
+
+		void *flush_routine(void *) {
+			auto &l = logger();
+			std::vector<Entry> batch;
+			pthread_mutex_lock(&l.mutex);
+			while (!l.stopping) {
+				timespec deadline = deadline_after(flush_interval_ns);
+				pthread_cond_timedwait(&l.wake_cond, &l.mutex, &deadline);
+				pthread_mutex_unlock(&l.mutex);
+				flush(l, batch);
+				pthread_mutex_lock(&l.mutex);
+			}
+			pthread_mutex_unlock(&l.mutex);
+			flush(l, batch);
+			return nullptr;
+		}
+	}
+
+	int start(FILE *out) {
+		auto &l = logger();
+		if (l.running) return 0;
+		l.out = out;
+		l.wall_offset_ns = wallOffset();
+		l.stopping = false;
+		l.running = true;
+		if (pthread_create(&l.flusher, nullptr, flush_routine, nullptr) != 0) {
+			perror("logger pthread_create");
+			l.running = false;
+			return -1;
+		}
+		pthread_setname_np(l.flusher, "log-flush");
+		return 0;
+	}
+
+	void stop() {
+		auto &l = logger();
+		if (!l.running) return;
+		// later records are written synchronously
+		l.running = false;
+		pthread_mutex_lock(&l.mutex);
+		l.stopping = true;
+		pthread_cond_signal(&l.wake_cond);
+		pthread_mutex_unlock(&l.mutex);
+		if (pthread_join(l.flusher, nullptr) != 0)
+			perror("logger pthread_join");
+	}
+
+	void write(const Level level, const char *fmt, ...) {
+		Record r;
+		r.ns = now_ns();
+		r.level = level;
+		va_list args;
+		va_start(args, fmt);
+		const int n = vsnprintf(r.text, text_size, fmt, args);
+		va_end(args);
+		r.len = (uint32_t) std::clamp(n, 0, (int) text_size - 1);
+
+		auto &l = logger();
+		if (!l.running.load(std::memory_order_acquire)) {
+			char name[16] = "";
+			pthread_getname_np(pthread_self(), name, sizeof(name));
+			print(l.out, r, name, syscall(SYS_gettid), wallOffset());
+			fflush(l.out);
+			return;
+		}
+		if (!slot.get().ring.tryPush(r)) {
+			l.dropped.fetch_add(1, std::memory_order_relaxed);
+			stats::add(dropped_counter);
+		}
+	}
+
+	uint64_t dropped() { return logger().dropped; }
+}
@@ -0,0 +1,52 @@
+//
+// Asynchronous logger: records go to per-thread lock-free rings, a flusher thread writes them out.
+//
+
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <cstdint>
+#include <cstdio>
+
+namespace logging {
+	enum class Level { Debug, Info, Warn, Error };
+
+	// A log call formats into a fixed size record (longer messages are cut) stamped with the
+	// monotonic clock and pushes it on the calling thread's ring, it never blocks or does I/O.
+	// When the ring is full the record is dropped and counted. The flusher wakes every few
+	// milliseconds and writes what all threads logged in timestamp order.
+	// Before start() (and after stop()) records are written synchronously.
+	int start(FILE *out = stdout);
+
+	// writes out what is left and joins the flusher
+	void stop();
+
+	void write(Level level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+	// records dropped on full rings
+	uint64_t dropped();
+}
+
+// Log levels below LOG_MIN_LEVEL are compiled out: 0 debug, 1 info, 2 warn, 3 error
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+#if LOG_MIN_LEVEL <= 0
+#define LOGD(...) logging::write(logging::Level::Debug, __VA_ARGS__)
+#else
+#define LOGD(...) ((void) 0)
+#endif
+#if LOG_MIN_LEVEL <= 1
+#define LOGI(...) logging::write(logging::Level::Info, __VA_ARGS__)
+#else
+#define LOGI(...) ((void) 0)
+#endif
+#if LOG_MIN_LEVEL <= 2
+#define LOGW(...) logging::write(logging::Level::Warn, __VA_ARGS__)
+#else
+#define LOGW(...) ((void) 0)
+#endif
+#define LOGE(...) logging::write(logging::Level::Error, __VA_ARGS__)
+
+#endif
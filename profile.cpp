@@ -0,0 +1,111 @@
+//
+// Lock and queue profiling for pthread_patterns, compiled in with -DPTHP_PROFILE.
+//
+
+#include "profile.hpp"
+
+#include <cerrno>
+
+#include "stats.hpp"
+
+namespace prof {
+	namespace {
+		std::string metric(const char *kind, const char *name, const char *what) {
+			return std::string("pthp.") + kind + "." + name + "." + what;
+		}
+
+		// mutexes the calling thread holds, with when it took them
+		struct Held {
+			pthread_mutex_t *mutex;
+			int hold;
+			uint64_t since;
+		};
+
+		// deeper nesting than this goes untimed
+		constexpr int held_limit = 16;
+
+		thread_local Held held[held_limit];
+		thread_local int held_count = 0;
+
+		Held *findHeld(const pthread_mutex_t *mutex) {
+			for (int i = held_count - 1; i >= 0; i--)
+				if (held[i].mutex == mutex) return &held[i];
+			return nullptr;
+		}
+	}
+
+	Site::Site(const char *kind, const char *name) {
+		const std::string k = kind;
+		if (k == "mutex") {
+			count = stats::counter(metric(kind, name, "acquired"));
+			contended = stats::counter(metric(kind, name, "contended"));
+			wait = stats::histogram(metric(kind, name, "wait"));
+			hold = stats::histogram(metric(kind, name, "hold"));
+		} else if (k == "cond") {
+			count = stats::counter(metric(kind, name, "waits"));
+			wait = stats::histogram(metric(kind, name, "wait"));
+		} else {
+			count = stats::counter(metric(kind, name, "tasks"));
+			wait = stats::histogram(metric(kind, name, "queued"));
+			hold = stats::histogram(metric(kind, name, "run"));
+		}
+	}
+
+	int lock(pthread_mutex_t *mutex, const Site &site) {
+		int ret = pthread_mutex_trylock(mutex);
+		uint64_t waited = 0;
+		if (ret == EBUSY) {
+			const uint64_t start = now_ns();
+			ret = pthread_mutex_lock(mutex);
+			waited = now_ns() - start;
+			stats::add(site.contended);
+		}
+		if (ret != 0) return ret;
+		stats::add(site.count);
+		stats::record(site.wait, waited);
+		if (held_count < held_limit) held[held_count++] = {mutex, site.hold, now_ns()};
+		return 0;
+	}
+
+	int unlock(pthread_mutex_t *mutex) {
+		if (const auto h = findHeld(mutex)) {
+			stats::record(h->hold, now_ns() - h->since);
+			*h = held[--held_count];
+		}
+		return pthread_mutex_unlock(mutex);
+	}
+
+	int timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const timespec *deadline, const Site &site) {
+		const auto h = findHeld(mutex);
+		const uint64_t start = now_ns();
+		if (h) stats::record(h->hold, start - h->since);
+		const int ret = deadline
+			                ? pthread_cond_timedwait(cond, mutex, deadline)
+			                : pthread_cond_wait(cond, mutex);
+		const uint64_t end = now_ns();
+		stats::add(site.count);
+		stats::record(site.wait, end - start);
+		// held again from here
+		if (h) h->since = end;
+		return ret;
+	}
+
+	int wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const Site &site) {
+		return timedwait(cond, mutex, nullptr, site);
+	}
+
+	void queued(const Site &site, const uint64_t ns) {
+		stats::add(site.count);
+		stats::record(site.wait, ns);
+	}
+
+	TaskTimer::~TaskTimer() { stats::record(site.hold, now_ns() - start); }
+
+	std::string report() {
+#ifdef PTHP_PROFILE
+		return stats::report("pthp.");
+#else
+		return "";
+#endif
+	}
+}
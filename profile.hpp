@@ -0,0 +1,78 @@
+//
+// Lock and queue profiling for pthread_patterns, compiled in with -DPTHP_PROFILE.
+//
+
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <cstdint>
+#include <pthread.h>
+#include <string>
+
+#include "PthTools.hpp"
+
+namespace prof {
+	// Metric ids of one named mutex, condvar or task queue, kept as stats metrics named
+	// "pthp.<kind>.<name>.<metric>". Ids a kind doesn't record are -1.
+	//   mutex: acquired, contended (lock had to block), wait, hold
+	//   cond:  waits, wait
+	//   task:  tasks, queued, run
+	struct Site {
+		int count = -1, contended = -1, wait = -1, hold = -1;
+
+		Site(const char *kind, const char *name);
+	};
+
+	// pthread_mutex_lock, counting the acquisition and timing the wait if it blocks
+	int lock(pthread_mutex_t *mutex, const Site &site);
+
+	// pthread_mutex_unlock, recording how long the calling thread held mutex
+	int unlock(pthread_mutex_t *mutex);
+
+	// pthread_cond_wait / timedwait, timing the wait. The mutex hold is split around it.
+	int wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const Site &site);
+
+	int timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const timespec *deadline, const Site &site);
+
+	// time a task spent queued before a thread took it
+	void queued(const Site &site, uint64_t ns);
+
+	// records a task's run time from construction to destruction
+	class TaskTimer {
+		const Site &site;
+		const uint64_t start = now_ns();
+
+	public:
+		explicit TaskTimer(const Site &site) : site(site) {}
+
+		~TaskTimer();
+
+		TaskTimer(const TaskTimer &) = delete;
+
+		TaskTimer &operator=(const TaskTimer &) = delete;
+	};
+
+	// the profiling metrics, as stats::report prints them. Empty unless built with PTHP_PROFILE.
+	std::string report();
+}
+
+// Instrumented primitives. Without PTHP_PROFILE they are the plain pthread calls.
+// name identifies the site in the report and must be a string literal.
+#ifdef PTHP_PROFILE
+#define PTHP_SITE(kind, name) ([]() -> const prof::Site & { static const prof::Site site(kind, name); return site; }())
+#define PTHP_LOCK(mutex, name) prof::lock(mutex, PTHP_SITE("mutex", name))
+#define PTHP_UNLOCK(mutex) prof::unlock(mutex)
+#define PTHP_WAIT(cond, mutex, name) prof::wait(cond, mutex, PTHP_SITE("cond", name))
+#define PTHP_TIMEDWAIT(cond, mutex, deadline, name) prof::timedwait(cond, mutex, deadline, PTHP_SITE("cond", name))
+#define PTHP_TASK_QUEUED(name, ns) prof::queued(PTHP_SITE("task", name), ns)
+#define PTHP_TASK_TIMER(name) const prof::TaskTimer pthp_task_timer(PTHP_SITE("task", name))
+#else
+#define PTHP_LOCK(mutex, name) pthread_mutex_lock(mutex)
+#define PTHP_UNLOCK(mutex) pthread_mutex_unlock(mutex)
+#define PTHP_WAIT(cond, mutex, name) pthread_cond_wait(cond, mutex)
+#define PTHP_TIMEDWAIT(cond, mutex, deadline, name) pthread_cond_timedwait(cond, mutex, deadline)
+#define PTHP_TASK_QUEUED(name, ns) ((void) 0)
+#define PTHP_TASK_TIMER(name) ((void) 0)
+#endif
+
+#endif
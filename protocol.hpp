@@ -0,0 +1,184 @@
+//
+// Client/server wire protocol: length-prefixed frames, with a line based text mode
+// kept for plain clients (nc, telnet, client).
+//
+
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+namespace proto {
+	// Every frame is a header followed by length payload bytes. Header fields are in
+	// network byte order:
+	//   magic (1) | flags (1) | reserved (2) | request id (4) | length (4)
+	// A request frame carries one text command (e.g. "newgraph 10 20 1 5", or
+	// "graph 3 0" followed by one adjacency line per vertex).
+	// A request is answered by any number of frames carrying its id, sent as results
+	// become ready, in any order across requests. The one flagged FINAL ends it.
+	// A connection is framed if its first byte is frame_magic, text otherwise.
+	constexpr uint8_t frame_magic = 0xa7;
+	constexpr size_t header_size = 12;
+	constexpr uint32_t max_frame_length = 16 << 20;
+	// longest text mode line
+	constexpr size_t max_line_length = 64 << 10;
+
+	enum FrameFlags : uint8_t {
+		FINAL = 1 << 0,
+		// request failed or was refused (e.g. busy), the payload says why
+		ERROR = 1 << 1,
+		// with ERROR: refused under load, the payload ends with "retry after <n> ms"
+		BUSY = 1 << 2,
+	};
+
+	struct FrameHeader {
+		uint8_t flags = 0;
+		uint32_t request_id = 0;
+		uint32_t length = 0;
+	};
+
+	inline void encodeHeader(char *out, const FrameHeader &header) {
+		const uint32_t id = htonl(header.request_id), length = htonl(header.length);
+		out[0] = (char) frame_magic;
+		out[1] = (char) header.flags;
+		out[2] = out[3] = 0;
+		memcpy(out + 4, &id, 4);
+		memcpy(out + 8, &length, 4);
+	}
+
+	// returns false if in does not start with a frame header
+	inline bool decodeHeader(const char *in, FrameHeader &header) {
+		if ((uint8_t) in[0] != frame_magic) return false;
+		uint32_t id, length;
+		memcpy(&id, in + 4, 4);
+		memcpy(&length, in + 8, 4);
+		header = {(uint8_t) in[1], ntohl(id), ntohl(length)};
+		return true;
+	}
+
+	inline std::string encodeFrame(const uint32_t request_id, const uint8_t flags, const std::string_view payload) {
+		std::string frame(header_size + payload.size(), '\0');
+		encodeHeader(frame.data(), {flags, request_id, (uint32_t) payload.size()});
+		if (!payload.empty()) memcpy(frame.data() + header_size, payload.data(), payload.size());
+		return frame;
+	}
+
+	// one request cut from the stream
+	struct Request {
+		uint32_t id = 0;
+		bool framed = false;
+		std::string text;
+	};
+
+	// Incremental request decoder for one connection. Text mode requests are lines, except
+	// "graph <V> <directed>" which takes the V adjacency lines after it along.
+	class RequestReader {
+		enum { UNKNOWN, TEXT, FRAMED } mode = UNKNOWN;
+		std::string buffer;
+		size_t consumed = 0;
+		// text mode: id given to the next request
+		uint32_t next_text_id = 0;
+		// text mode, the request being cut: offset past its last complete line (from consumed)
+		// and the adjacency lines still to come, -1 until its header line is in
+		size_t text_scanned = 0;
+		long text_lines_left = -1;
+		bool failed = false;
+
+		// reads one line from consumed on ; returns false if incomplete
+		bool line(size_t &pos, std::string_view &out) const {
+			const size_t end = buffer.find('\n', pos);
+			if (end == std::string::npos) return false;
+			out = std::string_view(buffer).substr(pos, end - pos);
+			if (!out.empty() && out.back() == '\r') out.remove_suffix(1);
+			pos = end + 1;
+			return true;
+		}
+
+		// adjacency lines following a text mode graph header, -1 if not a graph header
+		static long graphLines(const std::string_view header) {
+			std::istringstream in{std::string(header)};
+			std::string command;
+			long vertices;
+			if (!(in >> command)) return -1;
+			for (auto &c: command) c = (char) tolower(c);
+			if (command != "graph" || !(in >> vertices) || vertices < 0) return -1;
+			return vertices;
+		}
+
+		// continues where the last call stopped, a big graph arriving in pieces is scanned once
+		int nextText(Request &request) {
+			while (true) {
+				size_t pos = consumed + text_scanned;
+				std::string_view text_line;
+				if (text_lines_left < 0) {
+					if (!line(pos, text_line)) return buffer.size() - consumed > max_line_length ? fail() : 0;
+					// blank lines between commands are skipped
+					if (text_line.find_first_not_of(" \t") == std::string_view::npos) {
+						consumed = pos;
+						continue;
+					}
+					text_lines_left = std::max(0L, graphLines(text_line));
+					text_scanned = pos - consumed;
+				}
+				for (; text_lines_left > 0; text_lines_left--) {
+					if (!line(pos, text_line))
+						return buffer.size() - consumed > max_frame_length ? fail() : 0;
+					text_scanned = pos - consumed;
+				}
+				request = {next_text_id++, false, buffer.substr(consumed, pos - consumed)};
+				consumed = pos;
+				text_scanned = 0;
+				text_lines_left = -1;
+				return 1;
+			}
+		}
+
+		int nextFrame(Request &request) {
+			if (buffer.size() - consumed < header_size) return 0;
+			FrameHeader header;
+			if (!decodeHeader(buffer.data() + consumed, header) || header.length > max_frame_length)
+				return fail();
+			if (buffer.size() - consumed < header_size + header.length) return 0;
+			request = {header.request_id, true, buffer.substr(consumed + header_size, header.length)};
+			consumed += header_size + header.length;
+			return 1;
+		}
+
+		int fail() {
+			failed = true;
+			return -1;
+		}
+
+	public:
+		void feed(const char *data, const size_t len) {
+			// drop what was already handed out before growing
+			if (consumed > 0 && consumed >= buffer.size() / 2) {
+				buffer.erase(0, consumed);
+				consumed = 0;
+			}
+			buffer.append(data, len);
+			if (mode == UNKNOWN && !buffer.empty())
+				mode = (uint8_t) buffer[0] == frame_magic ? FRAMED : TEXT;
+		}
+
+		// cuts the next complete request ; returns 1 if one was read, 0 if more input is needed,
+		// -1 on a protocol error (bad frame, oversized request), after which the stream is unusable.
+		int next(Request &request) {
+			if (failed) return -1;
+			if (mode == FRAMED) return nextFrame(request);
+			if (mode == TEXT) return nextText(request);
+			return 0;
+		}
+
+		bool framed() const { return mode == FRAMED; }
+	};
+}
+
+#endif
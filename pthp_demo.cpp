@@ -35,6 +35,31 @@ void pipe_print(const NumPipeline::Work *work) {
 	std::cout << work->context << ": " << *work->payload << std::endl;
 }
 
+std::atomic<int> chained = 0;
+
+void pipe_count(const NumPipeline::Work *) {
+	++chained;
+}
+
+// pushes items through a linear add -> count route ; returns ms taken
+double run_chain(const int items, const bool single_producer, const bool fuse_counter = false) {
+	NumPipeline p;
+	const auto adder = p.startActiveObject(pipe_add, {.single_producer = single_producer});
+	const auto counter = p.startActiveObject(pipe_count, {.fused = fuse_counter, .single_producer = single_producer});
+
+	// one shared route, work and payloads recycled by the pipeline
+	const auto route = NumPipeline::makeRoute({{adder}, {counter}});
+	chained = 0;
+	const auto start = now_ns();
+	for (int i = 0; i < items; i++) {
+		NumPipeline::Job job(p, route, i);
+		job.payload() = i;
+		job.start();
+	}
+	while (chained < items) sched_yield();
+	return (double) (now_ns() - start) / 1e6;
+}
+
 void *graph_bfs(void *arg) {
 	typedef int graph;
 	const auto g = (graph *) arg;
@@ -89,6 +114,20 @@ int main() {
 	delete rs;
 	delete rp;
 	delete rm;
+
+	// typed futures: independent tasks run concurrently, joined by a single continuation
+	const std::vector futures = {
+		fs.submit([] { return 2 + 45; }),
+		fs.submit([] { return 2 * 45; }),
+		fs.submit([] { return std::min(2, 45); })
+	};
+	const auto total = lf::whenAll(futures).then(fs, [](const std::vector<int> &vals) {
+		int t = 0;
+		for (const auto v: vals) t += v;
+		return t;
+	});
+	printf("futures total %d\n", total.get());
+	fs.complete();
 	fs.stop();
 
 	NumPipeline p;
@@ -107,6 +146,12 @@ int main() {
 
 	sleep(3);
 
+	// stage hand-off cost: locked queues vs lock-free rings on a linear route
+	constexpr int items = 100000;
+	printf("%d items, locked queues: %.1f ms\n", items, run_chain(items, false));
+	printf("%d items, spsc rings: %.1f ms\n", items, run_chain(items, true));
+	printf("%d items, counter fused into adder: %.1f ms\n", items, run_chain(items, true, true));
+
 	delete args;
 
 
@@ -3,52 +3,63 @@
 namespace lf {
 	void *LF::thread_func(void *arg) {
 		const auto lf = (LF *) arg;
+		uint64_t idle_since = now_ns();
+		bool retired = false;
 
 		while (lf->running) {
 			// Follow leader
-			pthread_mutex_lock(&lf->leader_mutex);
-			while (lf->leader_set && lf->running)
-				pthread_cond_wait(&lf->leader_changed_cond, &lf->leader_mutex);
-			if (!lf->running) {
-				pthread_mutex_unlock(&lf->leader_mutex);
+			PTHP_LOCK(&lf->leader_mutex, "lf.leader");
+			while (lf->leader_set && lf->running && !retired) {
+				timespec deadline = deadline_after(lf->idle_timeout_ns);
+				PTHP_TIMEDWAIT(&lf->leader_changed_cond, &lf->leader_mutex, &deadline, "lf.leader_changed");
+				retired = lf->leader_set && lf->retire(idle_since);
+			}
+			if (!lf->running || retired) {
+				PTHP_UNLOCK(&lf->leader_mutex);
 				break;
 			}
 			lf->leader_set = true;
-			pthread_mutex_unlock(&lf->leader_mutex);
+			PTHP_UNLOCK(&lf->leader_mutex);
 
 			// Wait for tasks
-			pthread_mutex_lock(&lf->tasks_mutex);
-			while (lf->task_queue.empty() && lf->running)
-				pthread_cond_wait(&lf->tasks_changed_cond, &lf->tasks_mutex);
-			if (!lf->running && lf->task_queue.empty()) {
-				pthread_mutex_unlock(&lf->tasks_mutex);
-				pthread_mutex_lock(&lf->leader_mutex);
+			PTHP_LOCK(&lf->tasks_mutex, "lf.tasks");
+			while (lf->pending() == 0 && lf->running && !retired) {
+				timespec deadline = deadline_after(lf->idle_timeout_ns);
+				PTHP_TIMEDWAIT(&lf->tasks_changed_cond, &lf->tasks_mutex, &deadline, "lf.tasks_changed");
+				retired = lf->pending() == 0 && lf->retire(idle_since);
+			}
+			if (retired || (!lf->running && lf->pending() == 0)) {
+				PTHP_UNLOCK(&lf->tasks_mutex);
+				PTHP_LOCK(&lf->leader_mutex, "lf.leader");
 				lf->leader_set = false;
-				pthread_mutex_unlock(&lf->leader_mutex);
+				PTHP_UNLOCK(&lf->leader_mutex);
+				pthread_cond_signal(&lf->leader_changed_cond);
 				break;
 			}
 			// Consume task
-			auto tasks = lf->task_queue.front();
-			lf->task_queue.pop();
-			pthread_mutex_unlock(&lf->tasks_mutex);
+			auto tasks = lf->popNext();
+			PTHP_UNLOCK(&lf->tasks_mutex);
 
 			// Abdicate leadership
-			pthread_mutex_lock(&lf->leader_mutex);
+			PTHP_LOCK(&lf->leader_mutex, "lf.leader");
 			lf->leader_set = false;
-			pthread_mutex_unlock(&lf->leader_mutex);
+			PTHP_UNLOCK(&lf->leader_mutex);
 			pthread_cond_signal(&lf->leader_changed_cond);
 
 			// Run tasks
-			pthread_mutex_lock(&lf->tasks_mutex);
+			PTHP_LOCK(&lf->tasks_mutex, "lf.tasks");
 			++lf->working_threads;
-			pthread_mutex_unlock(&lf->tasks_mutex);
-			for (auto &task: tasks)
+			PTHP_UNLOCK(&lf->tasks_mutex);
+			for (auto &task: tasks) {
+				PTHP_TASK_TIMER("lf");
 				task();
+			}
 			// Notify task complete
-			pthread_mutex_lock(&lf->tasks_mutex);
+			PTHP_LOCK(&lf->tasks_mutex, "lf.tasks");
 			--lf->working_threads;
-			pthread_mutex_unlock(&lf->tasks_mutex);
+			PTHP_UNLOCK(&lf->tasks_mutex);
 			pthread_cond_broadcast(&lf->tasks_changed_cond);
+			idle_since = now_ns();
 		}
 
 		// wake any blocked threads
@@ -57,56 +68,193 @@ namespace lf {
 		return nullptr;
 	}
 
-	LF::LF(const int thread_count) {
-		thread_pool.reserve(thread_count);
-		for (int i = 0; i < thread_count; i++)
-			thread_pool.emplace_back(0);
+	LF::LF(const int min_threads, const int max_threads, const int idle_timeout_ms)
+		: min_threads(std::max(1, min_threads)), max_threads(std::max(std::max(1, min_threads), max_threads)),
+		  idle_timeout_ns((uint64_t) idle_timeout_ms * 1000000ull) {
+		thread_pool.reserve(this->max_threads);
+	}
+
+	int LF::spawn() {
+		pthread_t pid;
+		if (pthread_create(&pid, nullptr, thread_func, this) != 0) {
+			perror("pthread_create");
+			return -1;
+		}
+		pthread_setname_np(pid, "lf-worker");
+		int slot = -1;
+		if (!worker_cpus.empty()) {
+			// least used slot, so retired threads don't leave workers doubled up
+			std::vector<int> users(worker_cpus.size());
+			for (const int s: thread_slots)
+				if (s >= 0 && s < (int) users.size()) users[s]++;
+			slot = (int) (std::ranges::min_element(users) - users.begin());
+			cpu::pinThread(pid, worker_cpus[slot]);
+		}
+		thread_pool.push_back(pid);
+		thread_slots.push_back(slot);
+		return 0;
+	}
+
+	void LF::grow(const size_t queued, const int working) {
+		PTHP_LOCK(&pool_mutex, "lf.pool");
+		// reap threads that already retired
+		std::erase_if(retired_threads, [](const pthread_t pid) { return pthread_tryjoin_np(pid, nullptr) == 0; });
+		// busy threads, blocked ones included, offer no capacity
+		const int idle = (int) thread_pool.size() - working;
+		if (running && idle < (int) queued && (int) thread_pool.size() < max_threads)
+			spawn();
+		PTHP_UNLOCK(&pool_mutex);
+	}
+
+	bool LF::retire(const uint64_t idle_since) {
+		PTHP_LOCK(&pool_mutex, "lf.pool");
+		const auto size = (int) thread_pool.size();
+		const bool retire = running && (
+			                    size > max_threads ||
+			                    (size > min_threads && now_ns() - idle_since >= idle_timeout_ns)
+		                    );
+		if (retire) {
+			const auto it = std::ranges::find(thread_pool, pthread_self());
+			thread_slots.erase(thread_slots.begin() + (it - thread_pool.begin()));
+			thread_pool.erase(it);
+			retired_threads.push_back(pthread_self());
+		}
+		PTHP_UNLOCK(&pool_mutex);
+		return retire;
 	}
 
 	int LF::start() {
 		running = true;
-		for (pthread_t &pid: thread_pool) {
-			if (pthread_create(&pid, nullptr, thread_func, this) != 0) {
-				perror("pthread_create");
+		PTHP_LOCK(&pool_mutex, "lf.pool");
+		while ((int) thread_pool.size() < min_threads) {
+			if (spawn() != 0) {
+				PTHP_UNLOCK(&pool_mutex);
 				stop();
 				return -1;
 			}
 		}
+		PTHP_UNLOCK(&pool_mutex);
 		return 0;
 	}
 
-	void LF::stop() {
-		running = false;
+	void LF::resize(const int min_threads, const int max_threads) {
+		PTHP_LOCK(&pool_mutex, "lf.pool");
+		this->min_threads = std::max(1, min_threads);
+		this->max_threads = std::max(this->min_threads, max_threads);
+		while (running && (int) thread_pool.size() < this->min_threads)
+			if (spawn() != 0) break;
+		PTHP_UNLOCK(&pool_mutex);
+
+		// let idle threads above max notice and retire
 		pthread_cond_broadcast(&leader_changed_cond);
 		pthread_cond_broadcast(&tasks_changed_cond);
+	}
 
-		for (pthread_t &pid: thread_pool) {
-			if (pid != 0) {
-				if (pthread_join(pid, nullptr) != 0)
-					perror("pthread_join");
-				pid = 0;
-			}
-		}
+	void LF::setAffinity(const std::vector<cpu_set_t> &cpus) {
+		PTHP_LOCK(&pool_mutex, "lf.pool");
+		worker_cpus = cpus;
+		PTHP_UNLOCK(&pool_mutex);
+	}
+
+	int LF::threadCount() {
+		PTHP_LOCK(&pool_mutex, "lf.pool");
+		const int count = (int) thread_pool.size();
+		PTHP_UNLOCK(&pool_mutex);
+		return count;
+	}
+
+	size_t LF::queued() {
+		PTHP_LOCK(&tasks_mutex, "lf.tasks");
+		const size_t n = pending();
+		PTHP_UNLOCK(&tasks_mutex);
+		return n;
+	}
 
+	LF::~LF() {
+		stop();
 		pthread_mutex_destroy(&tasks_mutex);
 		pthread_mutex_destroy(&leader_mutex);
+		pthread_mutex_destroy(&pool_mutex);
 		pthread_cond_destroy(&tasks_changed_cond);
 		pthread_cond_destroy(&leader_changed_cond);
 	}
 
-	int LF::run(const std::vector<Func> &tasks) {
-		pthread_mutex_lock(&tasks_mutex);
-		task_queue.push(tasks);
+	void LF::stop() {
+		if (!running.exchange(false)) return;
+		pthread_cond_broadcast(&leader_changed_cond);
+		pthread_cond_broadcast(&tasks_changed_cond);
+
+		PTHP_LOCK(&pool_mutex, "lf.pool");
+		auto threads = std::move(thread_pool);
+		threads.insert(threads.end(), retired_threads.begin(), retired_threads.end());
+		thread_pool.clear();
+		thread_slots.clear();
+		retired_threads.clear();
+		PTHP_UNLOCK(&pool_mutex);
+
+		for (const pthread_t pid: threads)
+			if (pthread_join(pid, nullptr) != 0)
+				perror("pthread_join");
+#ifdef PTHP_PROFILE
+		if (!threads.empty()) fprintf(stderr, "%s", prof::report().c_str());
+#endif
+	}
+
+	size_t LF::pending() const {
+		size_t n = 0;
+		for (const auto &q: task_queues) n += q.size();
+		return n;
+	}
+
+	std::vector<Func> LF::popNext() {
+		// highest non-empty class, unless the oldest task of a lower class has starved.
+		// starved classes take every other pick, so a backlog of them can't starve the higher ones in turn
+		int pick = -1;
+		uint64_t oldest = UINT64_MAX;
+		const uint64_t now = now_ns();
+		bool starved = false;
+		for (int p = 0; p < priority_count; p++) {
+			if (task_queues[p].empty()) continue;
+			const uint64_t enqueued = task_queues[p].oldest().enqueued_ns;
+			if (pick == -1) {
+				pick = p;
+				oldest = enqueued;
+			} else if (!served_starved && now - enqueued > starvation_ns && enqueued < oldest) {
+				pick = p;
+				oldest = enqueued;
+				starved = true;
+			}
+		}
+		served_starved = starved;
+
+		auto next = task_queues[pick].pop();
+		PTHP_TASK_QUEUED("lf", now - next.enqueued_ns);
+		return std::move(next.tasks);
+	}
+
+	void LF::setStarvationLimit(const int ms) {
+		PTHP_LOCK(&tasks_mutex, "lf.tasks");
+		starvation_ns = (uint64_t) ms * 1000000ull;
+		PTHP_UNLOCK(&tasks_mutex);
+	}
+
+	int LF::run(const std::vector<Func> &tasks, const Priority priority, const Flow &flow) {
+		PTHP_LOCK(&tasks_mutex, "lf.tasks");
+		task_queues[(int) priority].push({tasks, now_ns()}, flow.key, flow.cost);
+		const size_t queued = pending();
+		const int working = working_threads;
 		pthread_cond_broadcast(&tasks_changed_cond);
-		pthread_mutex_unlock(&tasks_mutex);
+		PTHP_UNLOCK(&tasks_mutex);
+
+		grow(queued, working);
 		return 0;
 	}
 
 	void LF::complete() {
-		pthread_mutex_lock(&tasks_mutex);
-		while (!task_queue.empty() || working_threads > 0)
-			pthread_cond_wait(&tasks_changed_cond, &tasks_mutex);
-		pthread_mutex_unlock(&tasks_mutex);
+		PTHP_LOCK(&tasks_mutex, "lf.tasks");
+		while (pending() > 0 || working_threads > 0)
+			PTHP_WAIT(&tasks_changed_cond, &tasks_mutex, "lf.tasks_changed");
+		PTHP_UNLOCK(&tasks_mutex);
 	}
 }
 
@@ -2,22 +2,71 @@
 #define PTHREAD_PATTERNS_HPP
 
 
+#include <algorithm>
 #include <atomic>
 #include <cstdio>
+#include <exception>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <pthread.h>
 #include <queue>
+#include <type_traits>
 #include <vector>
 
+#include "cpu_affinity.hpp"
+#include "profile.hpp"
 #include "PthTools.hpp"
 
 namespace lf {
+	// Value of a future whose task returns void
+	struct Unit {
+	};
+
+	template<class T>
+	using value_t = std::conditional_t<std::is_void_v<T>, Unit, T>;
+
+	template<class T>
+	class Future;
+
+	// Scheduling classes, served highest first
+	enum class Priority { High, Normal, Low };
+
+	constexpr int priority_count = 3;
+
+	// Who queued a task and how costly it is, for fair queuing within a priority class.
+	// Flows (e.g. clients) take turns, a turn fits tasks worth one unit of cost.
+	struct Flow {
+		uint64_t key = 0;
+		double cost = 1;
+	};
+
 	class LF {
+		struct QueuedTasks {
+			std::vector<Func> tasks;
+			uint64_t enqueued_ns;
+		};
+
 		std::atomic<bool> running = true;
 
-		std::queue<std::vector<Func> > task_queue = std::queue<std::vector<Func> >();
+		// one fair queue per priority class, FIFO per flow
+		FairQueue<QueuedTasks> task_queues[priority_count];
+		// lower class tasks waiting longer than this are served first
+		uint64_t starvation_ns = 500 * 1000000ull;
+		// the last pick went to a starved lower class
+		bool served_starved = false;
 
+		// live threads, grown on demand between min and max
 		std::vector<pthread_t> thread_pool = std::vector<pthread_t>();
+		// threads that retired after idling, joined lazily
+		std::vector<pthread_t> retired_threads = std::vector<pthread_t>();
+		int min_threads, max_threads;
+		uint64_t idle_timeout_ns;
+		// cpus of each worker slot, empty for no pinning
+		std::vector<cpu_set_t> worker_cpus;
+		// worker slot of each live thread (as in thread_pool), -1 if unpinned
+		std::vector<int> thread_slots = std::vector<int>();
+		pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 		bool leader_set = false;
 		int working_threads = 0;
@@ -30,37 +79,299 @@ namespace lf {
 
 		static void *thread_func(void *arg);
 
+		// spawns a thread. pool_mutex must be held
+		int spawn();
+
+		// adds threads while queued tasks outnumber idle threads
+		void grow(size_t queued, int working);
+
+		// leaves the pool if idle long enough or above max. returns true if retired
+		bool retire(uint64_t idle_since);
+
+		size_t pending() const;
+
+		// pops the next task to run. tasks_mutex must be held, queues not empty
+		std::vector<Func> popNext();
+
 	public:
-		explicit LF(int thread_count = 4);
+		explicit LF(int thread_count = 4) : LF(thread_count, thread_count) {
+		}
+
+		LF(int min_threads, int max_threads, int idle_timeout_ms = 5000);
 
 		int start();
 
-		~LF() { stop(); }
+		// changes pool bounds. extra threads retire once idle
+		void resize(int min_threads, int max_threads);
+
+		int threadCount();
+
+		// task batches waiting for a thread
+		size_t queued();
+
+		// pins each new worker to the least used of cpus. applies to threads spawned after the call
+		void setAffinity(const std::vector<cpu_set_t> &cpus);
 
+		~LF();
+
+		// joins the threads. later calls do nothing until start() again
 		void stop();
 
-		int run(const std::vector<Func> &tasks);
+		int run(const std::vector<Func> &tasks, Priority priority = Priority::Normal, const Flow &flow = {});
+
+		int run(const Func &task, const Priority priority = Priority::Normal, const Flow &flow = {}) {
+			return run(std::vector{task}, priority, flow);
+		}
 
-		int run(const Func &task) { return run(std::vector{task}); }
+		// schedules f on the pool, returns a future to its result
+		template<class F>
+		auto submit(F f, Priority priority = Priority::Normal,
+		            const Flow &flow = {}) -> Future<value_t<std::invoke_result_t<F &> > >;
+
+		// max time a queued task may be overtaken by higher classes
+		void setStarvationLimit(int ms);
 
 		void complete();
 	};
+
+	namespace detail {
+		template<class T>
+		struct SharedState {
+			pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+			pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+			bool ready = false;
+			std::optional<T> value;
+			std::exception_ptr error;
+			std::vector<std::function<void()> > continuations;
+
+			~SharedState() {
+				pthread_mutex_destroy(&mutex);
+				pthread_cond_destroy(&ready_cond);
+			}
+
+			void settle(std::optional<T> &&v, std::exception_ptr e) {
+				PTHP_LOCK(&mutex, "future");
+				if (ready) {
+					PTHP_UNLOCK(&mutex);
+					return;
+				}
+				value = std::move(v);
+				error = std::move(e);
+				ready = true;
+				auto pending = std::move(continuations);
+				continuations.clear();
+				PTHP_UNLOCK(&mutex);
+				pthread_cond_broadcast(&ready_cond);
+
+				// run continuations outside the lock, they may settle other states
+				for (auto &c: pending) c();
+			}
+
+			// runs c once settled (immediately if already settled)
+			void onReady(std::function<void()> c) {
+				PTHP_LOCK(&mutex, "future");
+				if (!ready) {
+					continuations.push_back(std::move(c));
+					PTHP_UNLOCK(&mutex);
+					return;
+				}
+				PTHP_UNLOCK(&mutex);
+				c();
+			}
+
+			void wait() {
+				PTHP_LOCK(&mutex, "future");
+				while (!ready)
+					PTHP_WAIT(&ready_cond, &mutex, "future.ready");
+				PTHP_UNLOCK(&mutex);
+			}
+		};
+	}
+
+	// Write end of a future. Copies share the same state.
+	template<class T>
+	class Promise {
+		std::shared_ptr<detail::SharedState<T> > state = std::make_shared<detail::SharedState<T> >();
+
+	public:
+		void setValue(T value) const { state->settle(std::move(value), nullptr); }
+
+		void setError(std::exception_ptr error) const { state->settle(std::nullopt, std::move(error)); }
+
+		// runs f and settles with its result or thrown exception
+		template<class F, class... Args>
+		void fulfil(F &f, Args &... args) const {
+			try {
+				if constexpr (std::is_void_v<std::invoke_result_t<F &, Args &...> >) {
+					f(args...);
+					setValue(Unit{});
+				} else setValue(f(args...));
+			} catch (...) {
+				setError(std::current_exception());
+			}
+		}
+
+		Future<T> future() const { return Future<T>(state); }
+	};
+
+	// Read end of a task result. Copies share the same state.
+	template<class T>
+	class Future {
+		template<class>
+		friend class Promise;
+
+		std::shared_ptr<detail::SharedState<T> > state;
+
+		explicit Future(std::shared_ptr<detail::SharedState<T> > state) : state(std::move(state)) {
+		}
+
+	public:
+		bool ready() const {
+			PTHP_LOCK(&state->mutex, "future");
+			const bool r = state->ready;
+			PTHP_UNLOCK(&state->mutex);
+			return r;
+		}
+
+		// blocks until settled, rethrows the task exception if any
+		T &get() const {
+			state->wait();
+			if (state->error) std::rethrow_exception(state->error);
+			return *state->value;
+		}
+
+		// low level hook, c runs on the settling thread
+		void onReady(std::function<void()> c) const { state->onReady(std::move(c)); }
+
+		// schedules f(value) on pool once this future settles.
+		// f may also take no arguments. Errors skip f and propagate.
+		template<class F>
+		auto then(LF &pool, F f, const Priority priority = Priority::Normal) const {
+			using R = typename std::conditional_t<std::is_invocable_v<F &, T &>,
+				std::invoke_result<F &, T &>, std::invoke_result<F &> >::type;
+			Promise<value_t<R> > next;
+			state->onReady([&pool, priority, s = state, next, f]() mutable {
+				if (s->error) {
+					next.setError(s->error);
+					return;
+				}
+				pool.run(Func{.call = [s, next, f]() mutable {
+					if constexpr (std::is_invocable_v<F &, T &>) next.fulfil(f, *s->value);
+					else next.fulfil(f);
+				}}, priority);
+			});
+			return next.future();
+		}
+
+		// schedules f(error) on pool if this future settles with an error
+		template<class F>
+		void onError(LF &pool, F f, const Priority priority = Priority::Normal) const {
+			state->onReady([&pool, priority, s = state, f]() mutable {
+				if (!s->error) return;
+				pool.run(Func{.call = [s, f]() mutable { f(s->error); }}, priority);
+			});
+		}
+	};
+
+	template<class F>
+	auto LF::submit(F f, const Priority priority, const Flow &flow) -> Future<value_t<std::invoke_result_t<F &> > > {
+		Promise<value_t<std::invoke_result_t<F &> > > promise;
+		run(Func{.call = [promise, f]() mutable { promise.fulfil(f); }}, priority, flow);
+		return promise.future();
+	}
+
+	// fan-in join: settles with all values (in input order) once every future settled,
+	// or with the first error found.
+	template<class T>
+	Future<std::vector<T> > whenAll(const std::vector<Future<T> > &futures) {
+		struct Join {
+			std::atomic<size_t> remaining;
+			std::vector<Future<T> > futures;
+			Promise<std::vector<T> > promise;
+		};
+
+		const auto join = std::make_shared<Join>(futures.size(), futures);
+		auto result = join->promise.future();
+		if (futures.empty()) {
+			join->promise.setValue({});
+			return result;
+		}
+
+		for (const auto &f: futures)
+			f.onReady([join] {
+				if (--join->remaining > 0) return;
+				std::vector<T> values;
+				values.reserve(join->futures.size());
+				try {
+					for (const auto &done: join->futures)
+						values.push_back(done.get());
+				} catch (...) {
+					join->promise.setError(std::current_exception());
+					return;
+				}
+				join->promise.setValue(std::move(values));
+			});
+		return result;
+	}
 }
 
 namespace pl {
+	// What admission to a full stage queue does
+	enum class Overflow { Block, Reject };
+
+	struct StageConfig {
+		// max queued work items, 0 for unbounded
+		size_t capacity = 0;
+		// applies to Job::start only, hand-offs between stages always block.
+		// admission checks before queueing, so racing jobs may briefly block instead.
+		Overflow overflow = Overflow::Block;
+		// pin the stage threads, nullptr for no pinning
+		const cpu_set_t *cpus = nullptr;
+		// threads serving the stage
+		int workers = 1;
+		// work of the same context is handled one at a time, in arrival order.
+		// each worker then gets its own queue, capacity applies per queue.
+		bool ordered = false;
+		// for cheap stages: no threads, the thread handing work over runs the stage inline.
+		// an ordered fused stage keeps one lock per worker slot to serialize contexts.
+		bool fused = false;
+		// only one thread ever queues work here (e.g. the single thread of the stage
+		// before it on a linear route). the stage then hands off through a lock-free
+		// ring (capacity, or 1024 slots) instead of a locked queue. needs workers == 1.
+		bool single_producer = false;
+	};
+
 	template<class Context, class Payload>
 	class Pipeline {
 		class ActiveObject;
 
 	public:
 		typedef ActiveObject *Stage;
+		// stages a work item visits together, more than one fans out
+		typedef std::vector<Stage> Step;
+		// steps in visit order. immutable once built, shared by all work on it
+		typedef std::vector<Step> Route;
+		typedef std::shared_ptr<const Route> RouteRef;
 
 		struct Work {
 			Context context;
 			Payload *payload;
 
-			std::queue<Stage> stagesLeft = std::queue<Stage>();
-
+			RouteRef route;
+			// index of the step the work is on
+			size_t step = 0;
+			// stages of the current step not yet done with the work
+			std::atomic<size_t> pending = 0;
+			// pipeline whose pool the work returns to, nullptr if plainly deleted
+			Pipeline *pool = nullptr;
+			// fair queuing on stages: who the work is for and its cost (see lf::Flow)
+			uint64_t flow = 0;
+			double cost = 1;
+#ifdef PTHP_PROFILE
+			// when last queued on a stage
+			uint64_t enqueued_ns = 0;
+#endif
 
 			explicit Work(Context context, Payload *payload) : context(context), payload(payload) {
 			}
@@ -68,113 +379,386 @@ namespace pl {
 			~Work() { delete payload; }
 		};
 
+		// Stages of a fan-out step run concurrently on the same work and
+		// must only touch their own part of the payload.
 		typedef void (*Worker)(const Work *);
 
 	private:
+		// drops a stage's hold on work ; true if it was the last one
+		static bool release(Work *work) {
+			return work->pending.fetch_sub(1, std::memory_order_acq_rel) == 1;
+		}
+
+		static void dispatch(Work *work, const Step &step);
+
+		// retired work kept for reuse, payloads reset
+		std::vector<Work *> work_pool;
+		pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+		static constexpr size_t work_pool_limit = 1024;
+
+		void recycle(Work *work) {
+			work->route.reset();
+			// don't keep what the context or payload refers to alive while pooled
+			work->context = Context();
+			*work->payload = Payload();
+			PTHP_LOCK(&pool_mutex, "pl.pool");
+			if (work_pool.size() < work_pool_limit) {
+				work_pool.push_back(work);
+				work = nullptr;
+			}
+			PTHP_UNLOCK(&pool_mutex);
+			delete work;
+		}
+
+		static void dispose(Work *work) {
+			if (work->pool) work->pool->recycle(work);
+			else delete work;
+		}
+
+		// called by each stage done with work. the last one of a step moves it on to the next step.
+		static void advance(Work *work) {
+			if (!release(work)) return;
+			if (++work->step >= work->route->size()) {
+				// No more stages left, work is exhausted. Cleanup
+				dispose(work);
+				return;
+			}
+			dispatch(work, (*work->route)[work->step]);
+		}
+
 		class ActiveObject {
+			// A work queue served by one or more of the stage threads
+			struct Lane {
+				ActiveObject *owner;
+				// fair across flows, FIFO within one
+				FairQueue<Work *> workQueue = FairQueue<Work *>();
+				// lock-free replacement of workQueue for single producer stages
+				SpscRing<Work *> *ring = nullptr;
+				// taken in a batch and not yet done here, counts against capacity
+				std::atomic<size_t> in_batch = 0;
+				// ring sides sleeping on task_cond / space_cond
+				std::atomic_bool consumer_parked = false;
+				std::atomic_bool producer_parked = false;
+				pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
+				pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
+				pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+				// serializes inline runs of fused ordered stages
+				pthread_mutex_t inline_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+				explicit Lane(ActiveObject *owner) : owner(owner) {
+				}
+
+				~Lane() {
+					delete ring;
+					pthread_mutex_destroy(&inline_mutex);
+					pthread_mutex_destroy(&task_mutex);
+					pthread_cond_destroy(&task_cond);
+					pthread_cond_destroy(&space_cond);
+				}
+			};
+
 			const Worker worker;
-			std::queue<Work *> workQueue = std::queue<Work *>();
+			const size_t capacity;
+			const Overflow overflow;
+			const int workers;
+			const bool ordered;
+			const bool fused;
+			// ordered stages give each worker its own lane, picked by context
+			std::vector<Lane *> lanes;
 
 			std::atomic_bool active = false;
-			pthread_t thread{};
-			pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
-			pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
-
-			static void *thread_func(void *arg) {
-				const auto self = (ActiveObject *) arg;
+			std::vector<pthread_t> threads;
+			cpu_set_t cpus{};
+
+			// ring polls before parking
+			static constexpr int spin_limit = 2000;
+			// max work taken off a ring at once
+			static constexpr size_t ring_batch_limit = 64;
+
+			// wakes the other ring side if it parked
+			static void unpark(Lane *lane, std::atomic_bool &parked, pthread_cond_t *cond) {
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!parked.load(std::memory_order_relaxed)) return;
+				PTHP_LOCK(&lane->task_mutex, "pl.lane");
+				pthread_cond_signal(cond);
+				PTHP_UNLOCK(&lane->task_mutex);
+			}
 
-				while (self->active) {
-					// Wait for work on queue
-					pthread_mutex_lock(&self->task_mutex);
-					while (self->workQueue.empty() && self->active)
-						pthread_cond_wait(&self->task_cond, &self->task_mutex);
-					if (!self->active) {
-						pthread_mutex_unlock(&self->task_mutex);
-						break;
+			// spins, then parks until work arrives ; nullptr once stopped
+			Work *takeRing(Lane *lane) {
+				Work *work;
+				for (int spin = 0; spin < spin_limit && active; spin++) {
+					if (lane->ring->tryPop(work)) {
+						unpark(lane, lane->producer_parked, &lane->space_cond);
+						return work;
 					}
+					cpu_relax();
+				}
+				PTHP_LOCK(&lane->task_mutex, "pl.lane");
+				while (true) {
+					lane->consumer_parked = true;
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					if (lane->ring->tryPop(work) || !active) break;
+					PTHP_WAIT(&lane->task_cond, &lane->task_mutex, "pl.task");
+				}
+				lane->consumer_parked = false;
+				PTHP_UNLOCK(&lane->task_mutex);
+				if (!active) return nullptr;
+				unpark(lane, lane->producer_parked, &lane->space_cond);
+				return work;
+			}
 
-					// Consume work from queue
-					const auto work = self->workQueue.front();
-					self->workQueue.pop();
-					pthread_mutex_unlock(&self->task_mutex);
-
-					// Do work
-					/*
-					std::cout <<
-							"worker [" << pthread_self() << "] starting work with- " <<
-							"(c:" << work_context->context << ",p:" << *work_context->payload << ")" << std::endl;
-					*/
-					self->worker(work);
-
-					// Exit point
-					if (!self->active) {
-						while (self->workQueue.empty()) {
-							auto work_left = self->workQueue.front();
-							self->workQueue.pop();
-							delete work_left;
-						}
-						delete work;
-						break;
-					}
+			// waits for work on lane and takes what is queued into batch,
+			// leaving a fair share for the other workers of a shared lane ; false once stopped
+			bool takeBatch(Lane *lane, std::vector<Work *> &batch) {
+				batch.clear();
+				if (lane->ring) {
+					Work *work = takeRing(lane);
+					if (!work) return false;
+					batch.push_back(work);
+					while (batch.size() < ring_batch_limit && lane->ring->tryPop(work))
+						batch.push_back(work);
+					lane->in_batch.fetch_add(batch.size(), std::memory_order_relaxed);
+					unpark(lane, lane->producer_parked, &lane->space_cond);
+					return true;
+				}
 
-					if (work->stagesLeft.empty()) {
-						// No more stages left, work is exhausted. Cleanup
-						delete work;
+				PTHP_LOCK(&lane->task_mutex, "pl.lane");
+				while (lane->workQueue.empty() && active)
+					PTHP_WAIT(&lane->task_cond, &lane->task_mutex, "pl.task");
+				if (!active) {
+					PTHP_UNLOCK(&lane->task_mutex);
+					return false;
+				}
+				const size_t sharing = lanes.size() == 1 ? workers : 1;
+				// with several flows queued each pick is made when a worker is free,
+				// so light work doesn't wait behind a batch of heavy work
+				const size_t take = lane->workQueue.flowCount() > 1
+					                    ? 1
+					                    : std::max<size_t>(1, lane->workQueue.size() / sharing);
+				while (batch.size() < take)
+					batch.push_back(lane->workQueue.pop());
+				lane->in_batch.fetch_add(batch.size(), std::memory_order_relaxed);
+				PTHP_UNLOCK(&lane->task_mutex);
+				return true;
+			}
+
+			// a batch item is done on this stage, frees its place for queued producers
+			void finish(Lane *lane) {
+				if (!capacity || lane->ring) {
+					lane->in_batch.fetch_sub(1, std::memory_order_relaxed);
+					return;
+				}
+				PTHP_LOCK(&lane->task_mutex, "pl.lane");
+				lane->in_batch.fetch_sub(1, std::memory_order_relaxed);
+				PTHP_UNLOCK(&lane->task_mutex);
+				pthread_cond_broadcast(&lane->space_cond);
+			}
+
+			// spins, then parks while the ring is full ; false if stopped before space freed
+			bool putRing(Lane *lane, Work *work) {
+				for (int spin = 0; !lane->ring->tryPush(work); spin++) {
+					if (spin < spin_limit && active) {
+						cpu_relax();
 						continue;
 					}
+					PTHP_LOCK(&lane->task_mutex, "pl.lane");
+					bool pushed;
+					while (true) {
+						lane->producer_parked = true;
+						std::atomic_thread_fence(std::memory_order_seq_cst);
+						if ((pushed = lane->ring->tryPush(work)) || !active) break;
+						PTHP_WAIT(&lane->space_cond, &lane->task_mutex, "pl.space");
+					}
+					lane->producer_parked = false;
+					PTHP_UNLOCK(&lane->task_mutex);
+					if (!pushed) return false;
+					break;
+				}
+				unpark(lane, lane->consumer_parked, &lane->task_cond);
+				return true;
+			}
+
+			static void *thread_func(void *arg) {
+				const auto lane = (Lane *) arg;
+				const auto self = lane->owner;
+				std::vector<Work *> batch;
+
+				while (self->active) {
+					// Wait for work on queue, drain it in one go
+					if (!self->takeBatch(lane, batch)) break;
+
+					for (size_t i = 0; i < batch.size(); i++) {
+						const auto work = batch[i];
+						// Do work
+						/*
+						std::cout <<
+								"worker [" << pthread_self() << "] starting work with- " <<
+								"(c:" << work_context->context << ",p:" << *work_context->payload << ")" << std::endl;
+						*/
+						{
+							PTHP_TASK_QUEUED("pl", now_ns() - work->enqueued_ns);
+							PTHP_TASK_TIMER("pl");
+							self->worker(work);
+						}
+						self->finish(lane);
+
+						// Exit point
+						if (!self->active) {
+							lane->in_batch.fetch_sub(batch.size() - i - 1, std::memory_order_relaxed);
+							for (size_t j = i + 1; j < batch.size(); j++)
+								if (release(batch[j])) dispose(batch[j]);
+							batch.clear();
+							self->drain(lane);
+							if (release(work)) dispose(work);
+							return nullptr;
+						}
 
-					// Queue up work to next object
-					const auto next_object = work->stagesLeft.front();
-					work->stagesLeft.pop();
-					next_object->enqueue(work);
+						// Queue up work to next step
+						advance(work);
+					}
 				}
 
 				return nullptr;
 			}
 
+			// drops work left on lane
+			void drain(Lane *lane) {
+				PTHP_LOCK(&lane->task_mutex, "pl.lane");
+				while (!lane->workQueue.empty()) {
+					auto work_left = lane->workQueue.pop();
+					if (release(work_left)) dispose(work_left);
+				}
+				for (Work *work_left; lane->ring && lane->ring->tryPop(work_left);)
+					if (release(work_left)) dispose(work_left);
+				PTHP_UNLOCK(&lane->task_mutex);
+			}
+
+			Lane *laneFor(const Work *work) const {
+				if (lanes.size() == 1) return lanes.front();
+				return lanes[std::hash<Context>{}(work->context) % lanes.size()];
+			}
+
 		public:
-			explicit ActiveObject(const Worker worker) : worker(worker) {
+			explicit ActiveObject(const Worker worker, const StageConfig &config = {})
+				: worker(worker), capacity(config.capacity), overflow(config.overflow),
+				  workers(std::max(1, config.workers)), ordered(config.ordered), fused(config.fused) {
+				if (config.cpus) cpus = *config.cpus;
+				const int lane_count = config.ordered ? workers : 1;
+				for (int l = 0; l < lane_count; l++)
+					lanes.push_back(new Lane(this));
+				if (config.single_producer && workers == 1)
+					lanes.front()->ring = new SpscRing<Work *>(capacity ? capacity : 1024);
 			}
 
-			~ActiveObject() { stop(); }
+			~ActiveObject() {
+				stop();
+				for (const auto lane: lanes)
+					delete lane;
+			}
 
 			int start() {
 				active = true;
-				if (pthread_create(&thread, nullptr, thread_func, this) != 0) {
-					perror("pthread_create");
-					active = false;
-					return -1;
+				// fused stages run on their callers
+				for (int w = 0; w < workers && !fused; w++) {
+					pthread_t thread;
+					if (pthread_create(&thread, nullptr, thread_func, lanes[w % lanes.size()]) != 0) {
+						perror("pthread_create");
+						stop();
+						return -1;
+					}
+					pthread_setname_np(thread, "pl-stage");
+					cpu::pinThread(thread, cpus);
+					threads.push_back(thread);
 				}
 				return 0;
 			}
 
+			// true if admitting work now would be rejected
+			bool rejects(const Work *work) const {
+				if (fused || !capacity || overflow != Overflow::Reject) return false;
+				const auto lane = laneFor(work);
+				const size_t running = lane->in_batch.load(std::memory_order_relaxed);
+				if (lane->ring) return lane->ring->size() + running >= lane->ring->capacity();
+				PTHP_LOCK(&lane->task_mutex, "pl.lane");
+				const bool full = lane->workQueue.size() + running >= capacity;
+				PTHP_UNLOCK(&lane->task_mutex);
+				return full;
+			}
+
+			bool isFused() const { return fused; }
+
+			// runs work of a fused stage on the calling thread
+			void runInline(Work *work) {
+				// ordered stages still handle one work item per context at a time
+				const auto lane = laneFor(work);
+				if (ordered) PTHP_LOCK(&lane->inline_mutex, "pl.inline");
+				worker(work);
+				if (ordered) PTHP_UNLOCK(&lane->inline_mutex);
+				advance(work);
+			}
+
+			// queues work, waiting for space when full
 			void enqueue(Work *work) {
-				pthread_mutex_lock(&task_mutex);
-				workQueue.push(work);
-				pthread_mutex_unlock(&task_mutex);
-				pthread_cond_signal(&task_cond);
+				const auto lane = laneFor(work);
+#ifdef PTHP_PROFILE
+				work->enqueued_ns = now_ns();
+#endif
+				if (lane->ring) {
+					// pipeline stopping, work can't go on
+					if (!putRing(lane, work) && release(work)) dispose(work);
+					return;
+				}
+				PTHP_LOCK(&lane->task_mutex, "pl.lane");
+				while (capacity && lane->workQueue.size() + lane->in_batch.load(std::memory_order_relaxed) >= capacity &&
+				       active)
+					PTHP_WAIT(&lane->space_cond, &lane->task_mutex, "pl.space");
+				lane->workQueue.push(work, work->flow, work->cost);
+				PTHP_UNLOCK(&lane->task_mutex);
+				pthread_cond_signal(&lane->task_cond);
+			}
+
+			// work queued or taken in a batch and not yet done
+			size_t depth() const {
+				size_t d = 0;
+				for (const auto lane: lanes) {
+					d += lane->in_batch.load(std::memory_order_relaxed);
+					if (lane->ring) {
+						d += lane->ring->size();
+						continue;
+					}
+					PTHP_LOCK(&lane->task_mutex, "pl.lane");
+					d += lane->workQueue.size();
+					PTHP_UNLOCK(&lane->task_mutex);
+				}
+				return d;
 			}
 
 			int stop() {
 				active = false;
-				if (pthread_cond_signal(&task_cond) != 0) {
-					perror("pthread_cond_signal");
+				for (const auto lane: lanes) {
+					PTHP_LOCK(&lane->task_mutex, "pl.lane");
+					pthread_cond_broadcast(&lane->task_cond);
+					pthread_cond_broadcast(&lane->space_cond);
+					PTHP_UNLOCK(&lane->task_mutex);
 				}
-				if (pthread_join(thread, nullptr) != 0) {
-					perror("pthread_join");
-					return -1;
-				}
-				pthread_mutex_destroy(&task_mutex);
-				pthread_cond_destroy(&task_cond);
-				return 0;
+				int ret = 0;
+				for (const auto thread: threads)
+					if (pthread_join(thread, nullptr) != 0) {
+						perror("pthread_join");
+						ret = -1;
+					}
+				threads.clear();
+				return ret;
 			}
 		};
 
 		std::vector<ActiveObject *> activeObjects = std::vector<ActiveObject *>();
 
 	public:
-		Stage startActiveObject(const Worker worker) {
-			const auto object = new ActiveObject(worker);
+		// starts the stage threads
+		Stage startActiveObject(const Worker worker, const StageConfig &config = {}) {
+			const auto object = new ActiveObject(worker, config);
 			activeObjects.push_back(object);
 			object->start();
 			return object;
@@ -189,14 +773,69 @@ namespace pl {
 			}
 		}
 
+		// queued work per stage, in start order
+		std::vector<size_t> depths() const {
+			std::vector<size_t> d;
+			for (const auto object: activeObjects)
+				d.push_back(object->depth());
+			return d;
+		}
+
+		// builds a route once, for jobs to share
+		static RouteRef makeRoute(Route route) { return std::make_shared<const Route>(std::move(route)); }
+
+		// takes work from the pool (or a new one) with a fresh payload
+		Work *acquire(Context context) {
+			Work *work = nullptr;
+			PTHP_LOCK(&pool_mutex, "pl.pool");
+			if (!work_pool.empty()) {
+				work = work_pool.back();
+				work_pool.pop_back();
+			}
+			PTHP_UNLOCK(&pool_mutex);
+			if (!work) {
+				work = new Work(context, new Payload());
+				work->pool = this;
+			}
+			work->context = context;
+			work->step = 0;
+			work->flow = 0;
+			work->cost = 1;
+			return work;
+		}
+
 		class Job {
 			Work *work{};
 
-			std::queue<Stage> stages = std::queue<Stage>();
+			RouteRef route;
+			// steps added one by one, when not given a route
+			Route steps = Route();
 
 		public:
+			Job() = default;
+
+			// pooled work on a prebuilt route, fill in payload() then start()
+			Job(Pipeline &pipeline, RouteRef route, Context context)
+				: work(pipeline.acquire(context)), route(std::move(route)) {
+			}
+
+			Job(const Job &) = delete;
+
+			Job &operator=(const Job &) = delete;
+
+			// work not handed to the pipeline is dropped with the job
+			~Job() { if (work) dispose(work); }
+
+			Payload &payload() { return *work->payload; }
+
+			// queues the work fairly against other flows on every stage (see lf::Flow)
+			void setFlow(const uint64_t flow, const double cost) {
+				work->flow = flow;
+				work->cost = cost;
+			}
+
 			void setWork(Work *work) {
-				delete this->work;
+				if (this->work) dispose(this->work);
 				this->work = work;
 			}
 
@@ -204,14 +843,23 @@ namespace pl {
 				setWork(new Work(context, payload));
 			}
 
-			void addStage(const Stage stage) { stages.push(stage); }
+			void addStage(const Stage stage) { steps.push_back({stage}); }
+
+			// stages run concurrently on the work, the next step waits for all of them
+			void addFanOut(const Step &stages) { if (!stages.empty()) steps.push_back(stages); }
 
-			void start() {
-				if (stages.empty()) return;
-				work->stagesLeft = stages;
-				auto first_stage = stages.front();
-				work->stagesLeft.pop();
-				first_stage->enqueue(work);
+			// hands work to the first step ; returns -1 if it rejected it (stage full), work stays with the job.
+			int start() {
+				if (!route && !steps.empty()) route = makeRoute(steps);
+				if (!route || route->empty() || !work) return 0;
+				const auto &first_step = route->front();
+				for (const auto stage: first_step)
+					if (stage->rejects(work)) return -1;
+				work->route = route;
+				work->step = 0;
+				dispatch(work, first_step);
+				work = nullptr;
+				return 0;
 			}
 		};
 
@@ -221,8 +869,35 @@ namespace pl {
 			activeObjects.clear();
 		}
 
-		~Pipeline() { destroy(); }
+		~Pipeline() {
+			destroy();
+			for (const auto work: work_pool)
+				delete work;
+			pthread_mutex_destroy(&pool_mutex);
+		}
 	};
+
+	template<class Context, class Payload>
+	void Pipeline<Context, Payload>::dispatch(Work *work, const Step &step) {
+		// count every branch before any may finish
+		const size_t n = step.size();
+		work->pending.store(n, std::memory_order_release);
+		// once the last branch is handed over the work (and its route) may be gone,
+		// so step is not read past that point
+		size_t last_fused = n;
+		for (size_t i = 0; i < n; i++) {
+			const auto stage = step[i];
+			if (stage->isFused()) last_fused = i;
+			else stage->enqueue(work);
+		}
+		// fused stages run here, after the queued branches got going
+		for (size_t i = 0; i < n && last_fused < n; i++) {
+			const auto stage = step[i];
+			if (!stage->isFused()) continue;
+			stage->runInline(work);
+			if (i == last_fused) break;
+		}
+	}
 }
 
 #endif //PTHREAD_PATTERNS_HPP
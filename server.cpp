@@ -1,14 +1,25 @@
+#include <algorithm>
+#include <cstdarg>
 #include <csignal>
 #include <cstring>
+#include <getopt.h>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <unistd.h>
 #include <vector>
 #include <arpa/inet.h>
-#include <sys/poll.h>
+#include <sys/eventfd.h>
 
+#include "connection.hpp"
+#include "cpu_affinity.hpp"
 #include "fd_polling.hpp"
+#include "logger.hpp"
+#include "protocol.hpp"
 #include "pthread_patterns.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "graph/CostModel.h"
 #include "graph/EulerAlgorithm.h"
 #include "graph/Graph.h"
 #include "graph/MaxCliqueAlgorithm.h"
@@ -23,278 +34,850 @@ using namespace std;
 #endif
 
 typedef int fd_t;
+using reactor::Chunk;
+using reactor::ConnectionRef;
 
 
 void lower(char *p) { for (; *p; ++p) *p = (char) tolower(*p); }
 
 bool streq(const char *p1, const char *p2) { return strcmp(p1, p2) == 0; }
 
+// clients are served by io_uring proactors instead of epoll reactors
+bool uring_io = false;
+
+// a client request. answers to framed requests carry its id (see protocol.hpp)
+struct Request {
+	ConnectionRef client;
+	uint32_t id = 0;
+	bool framed = false;
+	// when the request was cut from the stream, for latency metrics
+	uint64_t received_ns = now_ns();
+	// ties the request's spans together, 0 while tracing is off
+	uint64_t trace_id = trace::newId();
+};
+
+typedef shared_ptr<const Request> RequestRef;
+
+// answer slot of each algorithm, in reply order
+enum AnswerSlot { MC, EU, MF, SC, SLOT_COUNT };
 
-string fmtAlgoRes(const Algorithm &algorithm, const string &result) {
-	return "\t" + algorithm.name() + " := " + result + "\n";
+const string answer_names[SLOT_COUNT] = {
+	MaxCliqueAlgorithm().name(), EulerAlgorithm().name(), MaxFlowAlgorithm().name(), SCCAlgorithm().name()
+};
+
+// trace span of an algorithm waiting to run, one name per algorithm so waits overlapping
+// on the request's track pair up
+const string queue_span_names[SLOT_COUNT] = {
+	"queue." + answer_names[MC], "queue." + answer_names[EU], "queue." + answer_names[MF], "queue." + answer_names[SC]
+};
+
+// request metrics, see the stats command
+namespace metrics {
+	const int requests = stats::counter("requests");
+	const int errors = stats::counter("error_replies");
+	const int busy = stats::counter("busy_replies");
+	// received to handed to an executor (command parsing, graph parsing or generation)
+	const int parse = stats::histogram("parse");
+	// handed to an executor to an algorithm starting on it
+	const int queue_wait = stats::histogram("queue_wait");
+	const int compute[SLOT_COUNT] = {
+		stats::histogram("compute." + answer_names[MC]), stats::histogram("compute." + answer_names[EU]),
+		stats::histogram("compute." + answer_names[MF]), stats::histogram("compute." + answer_names[SC])
+	};
+	// handing a reply to the I/O backend
+	const int write = stats::histogram("write");
+	// received to final reply
+	const int request = stats::histogram("request");
 }
 
-namespace graph_lf {
-	struct GraphWork {
-		fd_t requester = -1;
-		Graph *graph{};
-		Algorithm *algorithm{};
-		string *answer{};
-
-		~GraphWork() {
-			delete graph;
-			delete algorithm;
-			delete answer;
-		}
+// Admission control: a graph request is refused up front with a busy reply while the
+// executor it would go to is backed up, rather than queued behind work it can't beat.
+namespace admission {
+	enum Executor { LF_POOL, PIPELINE, BULK_POOL, EXECUTOR_COUNT };
+
+	// --max-queued: jobs waiting on an executor (LF task batches, work on an algorithm stage), 0 no limit
+	size_t max_queued = 0;
+	// --latency-budget: refuse while the executor is busy and recent queue waits exceed it, 0 off
+	uint64_t budget_ns = 0;
+	// --max-connections: clients served at once, 0 no limit
+	int max_connections = 0;
+	atomic<int> connections = 0;
+
+	// queue wait of recent jobs per executor, moving average
+	atomic<uint64_t> recent_wait_ns[EXECUTOR_COUNT] = {};
+
+	// shed decisions, by cause
+	const int shed_queue = stats::counter("shed.queue_full");
+	const int shed_budget = stats::counter("shed.latency_budget");
+	const int shed_connections = stats::counter("shed.connections");
+
+	void observeWait(const Executor executor, const uint64_t ns) {
+		// 1/8 weight, racing updates only lose a sample
+		const uint64_t avg = recent_wait_ns[executor].load(memory_order_relaxed);
+		recent_wait_ns[executor].store(avg - avg / 8 + ns / 8, memory_order_relaxed);
+	}
 
-		static void *compute_r(void *arg) {
-			const auto p = (GraphWork *) arg;
-			return new string(p->algorithm->run(*p->graph));
-		}
+	// retry hint: about how long queued jobs have been waiting
+	unsigned retryAfterMs(const Executor executor) {
+		const uint64_t ms = recent_wait_ns[executor].load(memory_order_relaxed) / 1000000;
+		return (unsigned) clamp<uint64_t>(ms, 10, 10000);
+	}
 
-		static void compute(void *arg) {
-			const auto p = (GraphWork *) arg;
-			p->answer = (string *) compute_r(arg);
+	// 0 if a job may be queued on executor with queued jobs waiting there, else ms to retry after
+	unsigned check(const Executor executor, const size_t queued) {
+		if (max_queued && queued >= max_queued) {
+			stats::add(shed_queue);
+			return retryAfterMs(executor);
+		}
+		if (budget_ns && queued > 0 && recent_wait_ns[executor].load(memory_order_relaxed) > budget_ns) {
+			stats::add(shed_budget);
+			return retryAfterMs(executor);
 		}
+		return 0;
+	}
+
+	// false if the client is over the connection limit, admitted clients are released on close
+	bool admitConnection() {
+		if (connections.fetch_add(1) < max_connections || !max_connections) return true;
+		connections.fetch_sub(1);
+		stats::add(shed_connections);
+		return false;
+	}
+
+	void releaseConnection() { connections.fetch_sub(1); }
+}
+
+// queues chunks as one answer to request through the active I/O backend, never blocks.
+// flags (proto::FrameFlags) only go out to framed clients, FINAL also ends a text request.
+void replyChunks(const Request &request, const uint8_t flags, vector<Chunk> chunks) {
+	const stats::Timer timer(metrics::write);
+	const trace::Span span(request.trace_id, "io", "write");
+	if (flags & proto::ERROR) stats::add(metrics::errors);
+	if (flags & proto::FINAL) {
+		stats::record(metrics::request, now_ns() - request.received_ns);
+		trace::asyncSpan(request.trace_id, "request", "request", request.received_ns, now_ns());
+	}
+	size_t length = 0;
+	for (const auto &chunk: chunks) length += chunk.size();
+	if (request.framed) {
+		string header(proto::header_size, '\0');
+		proto::encodeHeader(header.data(), {flags, request.id, (uint32_t) length});
+		chunks.insert(chunks.begin(), Chunk(std::move(header)));
+		length += proto::header_size;
+	}
+	if (!uring_io || request.client->fd == STDOUT_FILENO) {
+		request.client->send(std::move(chunks));
+		return;
+	}
+	if (request.client->isClosed()) return;
+	// the proactor sends one buffer per answer
+	string out;
+	out.reserve(length);
+	for (const auto &chunk: chunks) out += chunk.data();
+	proactor::sendUring(request.client->fd, request.client->uring_generation, std::move(out));
+}
 
-		static void *commit(void *arg) {
-			const auto p = (GraphWork *) arg;
+void reply(const Request &request, const uint8_t flags, const string_view text) {
+	vector<Chunk> chunks;
+	chunks.emplace_back(string(text));
+	replyChunks(request, flags, std::move(chunks));
+}
 
-			// send string answer to client fd requester
-			dprintf(p->requester, fmtAlgoRes(*p->algorithm, *p->answer).c_str());
+__attribute__((format(printf, 3, 4)))
+void respond(const Request &request, const uint8_t flags, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	char *text = nullptr;
+	const int len = vasprintf(&text, fmt, args);
+	va_end(args);
+	if (len < 0) return;
+	reply(request, flags, string_view(text, len));
+	free(text);
+}
 
-			delete p;
+void respond_busy(const Request &request, const char *reason, const unsigned retry_after_ms) {
+	stats::add(metrics::busy);
+	respond(request, proto::FINAL | proto::ERROR | proto::BUSY, "busy: %s, retry after %u ms\n", reason,
+	        retry_after_ms);
+}
 
-			return nullptr;
+
+// appends "\t<name> := <result>\n" to chunks, the result is sent from its own buffer
+void appendAnswer(vector<Chunk> &chunks, const AnswerSlot slot, string result) {
+	chunks.push_back(Chunk::view("\t"));
+	chunks.push_back(Chunk::view(answer_names[slot]));
+	chunks.push_back(Chunk::view(" := "));
+	chunks.emplace_back(std::move(result));
+	chunks.push_back(Chunk::view("\n"));
+}
+
+// estimated operations worth one fair queuing turn, and the most turns a job is charged
+// (estimates of exponential algorithms can be far off)
+constexpr double fair_turn_cost = 1e5;
+constexpr double max_fair_turns = 64;
+
+// fair queuing flow of request's client on the executors, charged by estimated cost
+lf::Flow client_flow(const Request &request, const double cost) {
+	return {(uint64_t) request.client->fd, clamp(cost / fair_turn_cost, 1.0, max_fair_turns)};
+}
+
+// runs algorithm A on graph for request, timed and traced
+template<class A>
+string run_algorithm(const Graph &graph, const Request &request, const AnswerSlot slot) {
+	const stats::Timer timer(metrics::compute[slot]);
+	const trace::Span span(request.trace_id, "compute", answer_names[slot].c_str());
+	return A().run(graph);
+}
+
+namespace graph_lf {
+	// estimated operation counts bounding the interactive and normal classes
+	constexpr double high_priority_cost = 1e5;
+	constexpr double normal_priority_cost = 1e8;
+
+	// scheduling class of an algorithm run, by its estimated cost
+	lf::Priority classify(const double cost) {
+		if (cost <= high_priority_cost) return lf::Priority::High;
+		if (cost <= normal_priority_cost) return lf::Priority::Normal;
+		return lf::Priority::Low;
+	}
+
+	// schedules algorithm A on graph, resolves to its result. queue is the admission
+	// queue of pool. framed requesters get the result as soon as it is ready, the future is then empty.
+	template<class A>
+	lf::Future<string> compute(lf::LF &pool, const admission::Executor queue, const shared_ptr<const Graph> &graph,
+	                           const RequestRef &requester, const AnswerSlot slot) {
+		const double cost = A().estimatedCost(*graph);
+		// each client's tasks queue on their own, clients take turns within a class
+		return pool.submit(
+			[graph, requester, slot, queue, queued = now_ns()] {
+				stats::record(metrics::queue_wait, now_ns() - queued);
+				admission::observeWait(queue, now_ns() - queued);
+				trace::asyncSpan(requester->trace_id, "lf", queue_span_names[slot].c_str(), queued, now_ns());
+				string result = run_algorithm<A>(*graph, *requester, slot);
+				if (!requester->framed) return result;
+				vector<Chunk> chunks;
+				appendAnswer(chunks, slot, std::move(result));
+				replyChunks(*requester, 0, std::move(chunks));
+				return string();
+			},
+			classify(cost),
+			client_flow(*requester, cost)
+		);
+	}
+
+	// completes requester: all answers in one go for text clients, the final frame otherwise.
+	// results are in slot order.
+	void commit(const RequestRef &requester, vector<string> results) {
+		if (requester->framed) {
+			reply(*requester, proto::FINAL, {});
+			return;
 		}
-	};
+		vector<Chunk> chunks;
+		for (size_t slot = 0; slot < SLOT_COUNT && slot < results.size(); slot++)
+			appendAnswer(chunks, (AnswerSlot) slot, std::move(results[slot]));
+		replyChunks(*requester, proto::FINAL, std::move(chunks));
+	}
+
+	// completes requester with the error that stopped one of its algorithms
+	void fail(const RequestRef &requester, const exception_ptr &error) {
+		try {
+			rethrow_exception(error);
+		} catch (const exception &ex) {
+			respond(*requester, proto::FINAL | proto::ERROR, "failed to run algorithms: %s\n", ex.what());
+		} catch (...) {
+			respond(*requester, proto::FINAL | proto::ERROR, "failed to run algorithms\n");
+		}
+	}
 };
 
 namespace graph_pl {
+	// pooled by the pipeline, reset on reuse. concurrent stages only write their own result slot,
+	// results are handed to the connection as they are sent.
 	class GraphPayload {
 	public:
-		const Graph *graph{};
-		vector<string> answers;
-
-		explicit GraphPayload(const Graph &g) : graph(new Graph(g)) {
-		}
-
-		~GraphPayload() {
-			delete graph;
-		}
+		Graph graph;
+		string results[SLOT_COUNT];
+		// when the job entered the pipeline
+		uint64_t queued_ns = 0;
 	};
 
-	typedef pl::Pipeline<fd_t, GraphPayload> GraphAlgoPipeline;
+	typedef pl::Pipeline<RequestRef, GraphPayload> GraphAlgoPipeline;
 
 	namespace workers {
 		namespace alg {
-			void mc(const GraphAlgoPipeline::Work *work) {
-				auto algo = MaxCliqueAlgorithm();
-				work->payload->answers.push_back(fmtAlgoRes(algo, algo.run(*work->payload->graph)));
+			// framed requesters get each answer as soon as its stage is done
+			template<class A>
+			void answer(const GraphAlgoPipeline::Work *work, const AnswerSlot slot) {
+				const auto &request = *work->context;
+				stats::record(metrics::queue_wait, now_ns() - work->payload->queued_ns);
+				admission::observeWait(admission::PIPELINE, now_ns() - work->payload->queued_ns);
+				trace::asyncSpan(request.trace_id, "pipeline", queue_span_names[slot].c_str(),
+				                 work->payload->queued_ns, now_ns());
+				auto &result = work->payload->results[slot];
+				result = run_algorithm<A>(work->payload->graph, request, slot);
+				if (work->context->framed) {
+					vector<Chunk> chunks;
+					appendAnswer(chunks, slot, std::move(result));
+					replyChunks(*work->context, 0, std::move(chunks));
+				}
 			}
 
-			void mf(const GraphAlgoPipeline::Work *work) {
-				auto algo = MaxFlowAlgorithm();
-				work->payload->answers.push_back(fmtAlgoRes(algo, algo.run(*work->payload->graph)));
-			}
+			void mc(const GraphAlgoPipeline::Work *work) { answer<MaxCliqueAlgorithm>(work, MC); }
 
-			void eu(const GraphAlgoPipeline::Work *work) {
-				auto algo = EulerAlgorithm();
-				work->payload->answers.push_back(fmtAlgoRes(algo, algo.run(*work->payload->graph)));
-			}
+			void mf(const GraphAlgoPipeline::Work *work) { answer<MaxFlowAlgorithm>(work, MF); }
 
-			void sc(const GraphAlgoPipeline::Work *work) {
-				auto algo = SCCAlgorithm();
-				work->payload->answers.push_back(fmtAlgoRes(algo, algo.run(*work->payload->graph)));
-			}
+			void eu(const GraphAlgoPipeline::Work *work) { answer<EulerAlgorithm>(work, EU); }
+
+			void sc(const GraphAlgoPipeline::Work *work) { answer<SCCAlgorithm>(work, SC); }
 		};
 
+		// join stage, runs once all algorithm stages are done. one send per request,
+		// so answers of requests finishing together never interleave.
 		void send_results(const GraphAlgoPipeline::Work *work) {
-			for (const auto &answer: work->payload->answers)
-				dprintf(work->context, "%s", answer.c_str());
-			work->payload->answers.clear();
+			if (work->context->framed) {
+				reply(*work->context, proto::FINAL, {});
+				return;
+			}
+			// gathered by a single writev, results are not copied
+			vector<Chunk> chunks;
+			for (size_t slot = 0; slot < SLOT_COUNT; slot++)
+				appendAnswer(chunks, (AnswerSlot) slot, std::move(work->payload->results[slot]));
+			replyChunks(*work->context, proto::FINAL, std::move(chunks));
 		}
 	};
 };
 
-// client job thread manager
-auto job_handler = lf::LF(3);
+// client job thread manager, sized in main
+auto job_handler = lf::LF(1);
+// graphs the cost model expects to run long, kept off job_handler's threads
+auto bulk_handler = lf::LF(1);
 auto pipeline_handler = graph_pl::GraphAlgoPipeline();
 vector<graph_pl::GraphAlgoPipeline::Stage> graph_pipeline_stages;
-
-// client fds
-vector<fd_t> client_fds;
-// client connection proactor for accepting clients
-pthread_t client_connection_proactor;
-// client list modification protection mutex
-pthread_mutex_t fds_modify_mutex;
+// algorithms side by side, joined by send_results. shared by all jobs
+graph_pl::GraphAlgoPipeline::RouteRef graph_route;
+const vector<string> graph_pipeline_stage_names = {"mc", "eu", "mf", "sc", "send_results"};
+
+// I/O threads, each reacting on its own listening socket and the clients it accepted
+vector<pthread_t> io_threads;
+// or io_uring proactors, one per listening socket
+vector<void *> uring_proactors;
+vector<fd_t> listen_fds;
+atomic<bool> io_running = false;
+// readable once I/O threads should stop
+fd_t io_stop_fd = -1;
+// stdin commands answer on stdout, written blocking
+const auto console = make_shared<reactor::Connection>(STDOUT_FILENO);
 
 
 void safe_exit(const int sig) {
-	// stop server client connection proactor
-	proactor::stopProactor(client_connection_proactor);
+	// stop server I/O threads
+	for (const auto p: uring_proactors)
+		proactor::stopUringProactor(p);
+	uring_proactors.clear();
+	io_running = false;
+	if (io_stop_fd >= 0) eventfd_write(io_stop_fd, 1);
+	for (const auto t: io_threads)
+		pthread_join(t, nullptr);
+	io_threads.clear();
+	for (const auto fd: listen_fds)
+		close(fd);
+	listen_fds.clear();
 
 	// wait for jobs to finish
 	job_handler.complete();
-	// stop job thread manager
+	bulk_handler.complete();
+	// stop job thread managers
 	job_handler.stop();
-
-	// close all fds
-	pthread_mutex_lock(&fds_modify_mutex);
-	for (const auto client: client_fds) {
-		printf("closing fd %d\n", client);
-		close(client);
-	}
-	pthread_mutex_unlock(&fds_modify_mutex);
-
-	// cleanup mutexes
-	pthread_mutex_destroy(&fds_modify_mutex);
+	bulk_handler.stop();
+	// write out the last log records
+	logging::stop();
 
 	// exit
 	exit(sig);
 }
 
 
-void run_algos_lf(const Graph &graph, const fd_t response_fd) {
-	printf("run_algos_lf for fd %d\n", response_fd);
-	const auto payloads = vector{
-		new graph_lf::GraphWork{response_fd, new Graph(graph), new MaxCliqueAlgorithm()},
-		new graph_lf::GraphWork{response_fd, new Graph(graph), new EulerAlgorithm()},
-		new graph_lf::GraphWork{response_fd, new Graph(graph), new MaxFlowAlgorithm()},
-		new graph_lf::GraphWork{response_fd, new Graph(graph), new SCCAlgorithm()}
+// runs the algorithms one after the other on the calling (I/O) thread, for graphs too small to be worth queueing
+void run_algos_inline(const Graph &graph, const RequestRef &request) {
+	LOGD("run_algos_inline for fd %d", request->client->fd);
+	stats::record(metrics::parse, now_ns() - request->received_ns);
+	trace::span(request->trace_id, "request", "parse", request->received_ns, now_ns());
+	vector<string> results = {
+		run_algorithm<MaxCliqueAlgorithm>(graph, *request, MC),
+		run_algorithm<EulerAlgorithm>(graph, *request, EU),
+		run_algorithm<MaxFlowAlgorithm>(graph, *request, MF),
+		run_algorithm<SCCAlgorithm>(graph, *request, SC)
+	};
+	if (request->framed)
+		for (size_t slot = 0; slot < SLOT_COUNT; slot++) {
+			vector<Chunk> chunks;
+			appendAnswer(chunks, (AnswerSlot) slot, std::move(results[slot]));
+			replyChunks(*request, 0, std::move(chunks));
+		}
+	graph_lf::commit(request, std::move(results));
+}
+
+void run_algos_lf(lf::LF &pool, const admission::Executor queue, const Graph &graph, const RequestRef &request) {
+	LOGD("run_algos_lf for fd %d", request->client->fd);
+	stats::record(metrics::parse, now_ns() - request->received_ns);
+	trace::span(request->trace_id, "request", "parse", request->received_ns, now_ns());
+	const auto shared_graph = make_shared<const Graph>(graph);
+	// algorithms run concurrently, a single commit runs once all are done
+	const vector<lf::Future<string> > answers = {
+		graph_lf::compute<MaxCliqueAlgorithm>(pool, queue, shared_graph, request, MC),
+		graph_lf::compute<EulerAlgorithm>(pool, queue, shared_graph, request, EU),
+		graph_lf::compute<MaxFlowAlgorithm>(pool, queue, shared_graph, request, MF),
+		graph_lf::compute<SCCAlgorithm>(pool, queue, shared_graph, request, SC)
+	};
+	// commit is cheap, don't hold finished results behind queued work
+	lf::whenAll(answers).then(pool, [request](vector<string> &results) {
+		graph_lf::commit(request, std::move(results));
+	}, lf::Priority::High).onError(pool, [request](const exception_ptr &error) {
+		graph_lf::fail(request, error);
+	}, lf::Priority::High);
+}
+
+// returns -1 if the pipeline is full and the job was rejected
+int run_algos_pl(const Graph &graph, const RequestRef &request) {
+	LOGD("run_algos_pl for fd %d", request->client->fd);
+	stats::record(metrics::parse, now_ns() - request->received_ns);
+	trace::span(request->trace_id, "request", "parse", request->received_ns, now_ns());
+	graph_pl::GraphAlgoPipeline::Job algo_job(pipeline_handler, graph_route, request);
+	algo_job.payload().graph = graph;
+	algo_job.payload().queued_ns = now_ns();
+	// clients take turns on every stage, charged for the whole job
+	const double cost = MaxCliqueAlgorithm().estimatedCost(graph) + EulerAlgorithm().estimatedCost(graph) +
+	                    MaxFlowAlgorithm().estimatedCost(graph) + SCCAlgorithm().estimatedCost(graph);
+	const auto flow = client_flow(*request, cost);
+	algo_job.setFlow(flow.key, flow.cost);
+	return algo_job.start();
+}
+
+// jobs on the deepest algorithm stage, send_results is fused and never queues
+size_t pipeline_queued() {
+	const auto depths = pipeline_handler.depths();
+	return *max_element(depths.begin(), depths.begin() + SLOT_COUNT);
+}
+
+// Executor selection: the cost model predicts each algorithm's run time on the graph and the
+// request goes where its last answer is expected soonest.
+namespace executor {
+	enum Kind { INLINE, LF_POOL, PIPELINE, BULK, KIND_COUNT };
+
+	// --cost-model: calibrated from graph_bench results, generic until then
+	CostModel model;
+	// --inline-below: all algorithms together taking less even in their slowest calibrated runs
+	// run on the I/O thread. never without a calibrated line for each of them
+	uint64_t inline_ns = 100000;
+	// --bulk-above: requests whose slowest algorithm is predicted to take longer go to bulk_handler
+	uint64_t bulk_ns = 250 * 1000000ull;
+
+	const int chosen[KIND_COUNT] = {
+		stats::counter("executor.inline"), stats::counter("executor.lf"),
+		stats::counter("executor.pipeline"), stats::counter("executor.bulk")
 	};
-	for (const auto p: payloads)
-		job_handler.run({
-			{graph_lf::GraphWork::compute_r, p, (void **) &p->answer},
-			{graph_lf::GraphWork::commit, p}
-		});
+
+	// preferred is taken when the shared executors are expected to do as well
+	Kind choose(const Graph &graph, const Kind preferred) {
+		const MaxCliqueAlgorithm mc;
+		const EulerAlgorithm eu;
+		const MaxFlowAlgorithm mf;
+		const SCCAlgorithm sc;
+		const Algorithm *algorithms[SLOT_COUNT] = {&mc, &eu, &mf, &sc};
+		bool calibrated = true;
+		double worst_total = 0, slowest = 0;
+		for (const auto algorithm: algorithms) {
+			calibrated = calibrated && model.calibrated(algorithm->name());
+			worst_total += model.predictWorstNs(*algorithm, graph);
+			slowest = max(slowest, model.predictNs(*algorithm, graph));
+		}
+		// the I/O thread's other clients wait meanwhile, only a calibrated bound will do
+		if (calibrated && worst_total < (double) inline_ns) return INLINE;
+		if (slowest > (double) bulk_ns) return BULK;
+
+		// both run the algorithms side by side, after what recent jobs waited if any are queued
+		const auto waited = [](const admission::Executor queue, const size_t queued) {
+			return queued ? (double) admission::recent_wait_ns[queue].load(memory_order_relaxed) : 0.0;
+		};
+		const double lf_ns = waited(admission::LF_POOL, job_handler.queued()) + slowest;
+		const double pl_ns = waited(admission::PIPELINE, pipeline_queued()) + slowest;
+		if (lf_ns < pl_ns) return LF_POOL;
+		if (pl_ns < lf_ns) return PIPELINE;
+		return preferred;
+	}
 }
 
-void run_algos_pl(const Graph &graph, const fd_t response_fd) {
-	printf("run_algos_pl for fd %d\n", response_fd);
-	graph_pl::GraphAlgoPipeline::Job algo_job;
-	algo_job.setWork(response_fd, new graph_pl::GraphPayload(graph));
-	for (const auto stage: graph_pipeline_stages)
-		algo_job.addStage(stage);
-	algo_job.start();
+// runs the algorithms on graph on the executor picked for it (preferred on a tie),
+// answers busy instead while that executor is backed up.
+void run_algos(const Graph &graph, const RequestRef &request, const executor::Kind preferred) {
+	const auto kind = executor::choose(graph, preferred);
+	stats::add(executor::chosen[kind]);
+	switch (kind) {
+		case executor::INLINE:
+			run_algos_inline(graph, request);
+			break;
+		case executor::PIPELINE:
+			if (const unsigned retry = admission::check(admission::PIPELINE, pipeline_queued())) {
+				respond_busy(*request, "graph pipeline is backed up", retry);
+				return;
+			}
+			if (run_algos_pl(graph, request) != 0)
+				respond_busy(*request, "graph pipeline is full", admission::retryAfterMs(admission::PIPELINE));
+			break;
+		default: {
+			auto &pool = kind == executor::BULK ? bulk_handler : job_handler;
+			const auto queue = kind == executor::BULK ? admission::BULK_POOL : admission::LF_POOL;
+			if (const unsigned retry = admission::check(queue, pool.queued())) {
+				respond_busy(*request, "job queue is backed up", retry);
+				return;
+			}
+			run_algos_lf(pool, queue, graph, request);
+		}
+	}
 }
 
 
-void parse_command_client(const fd_t response_fd, const char *command, const char *args) {
+void parse_command_client(const RequestRef &request, const char *command, const char *args) {
+	stats::add(metrics::requests);
 	Graph graph;
-	if (streq(command, "newgraph")) {
+	if (streq(command, "stats")) {
+		reply(*request, proto::FINAL, stats::report());
+	} else if (streq(command, "newgraph")) {
 		int v = 0, e = 0, mw = 0, Mw = 0;
 		bool directed = false;
 		try {
-			dprintf(response_fd, "newgraph args %s\n", args);
+			respond(*request, 0, "newgraph args %s\n", args);
 			istringstream in(args);
 			string cmd;
 			in >> cmd >> v >> e >> mw >> Mw;
 			graph = generateRandomGraph(v, e, directed, mw, Mw, time(nullptr));
-			dprintf(response_fd, "generated new random graph:\n\t%s\n", to_string_human(graph).c_str());
-			// run_algos_lf(graph, response_fd);
-			run_algos_pl(graph, response_fd);
+			respond(*request, 0, "generated new random graph:\n\t%s\n", to_string_human(graph).c_str());
+			run_algos(graph, request, executor::PIPELINE);
 		} catch (exception &ex) {
-			dprintf(response_fd, "failed to generate graph: %s\n", ex.what());
+			respond(*request, proto::FINAL | proto::ERROR, "failed to generate graph: %s\n", ex.what());
 		}
 	} else if (streq(command, "graph")) {
-		// parse graph
+		// parse graph, following the command word
 		try {
-			graph = from_string(std::string(args));
-			run_algos_lf(graph, response_fd);
+			istringstream in(args);
+			string cmd;
+			in >> cmd;
+			graph = from_string(string(istreambuf_iterator(in), {}));
+			run_algos(graph, request, executor::LF_POOL);
 		} catch (exception &ex) {
-			dprintf(response_fd, "failed to parse graph: %s", ex.what());
+			respond(*request, proto::FINAL | proto::ERROR, "failed to parse graph: %s\n", ex.what());
 		}
-	} else dprintf(response_fd, "unknown command \"%s\"\n", command);
+	} else respond(*request, proto::FINAL | proto::ERROR, "unknown command \"%s\"\n", command);
+}
+
+void parse_command_set(const char *args) {
+	istringstream in(args);
+	string cmd, key;
+	in >> cmd >> key;
+	if (key == "threads") {
+		int min_threads = 0, max_threads = 0;
+		if (!(in >> min_threads) || min_threads < 1) {
+			printf("usage: set threads <min> [max]\n");
+			return;
+		}
+		if (!(in >> max_threads)) max_threads = min_threads;
+		job_handler.resize(min_threads, max_threads);
+		printf("job threads: min %d max %d (now %d)\n",
+		       min_threads, max(min_threads, max_threads), job_handler.threadCount());
+	} else printf("unknown setting \"%s\"\n", key.c_str());
+}
+
+void print_queues() {
+	const auto depths = pipeline_handler.depths();
+	for (size_t s = 0; s < depths.size() && s < graph_pipeline_stage_names.size(); s++)
+		printf("\t%s: %zu queued\n", graph_pipeline_stage_names[s].c_str(), depths[s]);
+	printf("\tlf: %zu queued\n\tbulk: %zu queued\n", job_handler.queued(), bulk_handler.queued());
+}
+
+// trace on|off|dump [path]
+void parse_command_trace(const char *args) {
+	istringstream in(args);
+	string cmd, action, path = "trace.json";
+	in >> cmd >> action >> path;
+	if (action == "on" || action == "off") {
+		trace::enable(action == "on");
+		printf("tracing %s\n", action.c_str());
+	} else if (action == "dump") {
+		const long events = trace::dump(path);
+		if (events >= 0) printf("wrote %ld trace events to %s\n", events, path.c_str());
+	} else printf("usage: trace on|off|dump [path]\n");
 }
 
 void parse_command_stdin(const char *command, const char *buff) {
 	if (streq(command, "exit") || streq(command, "quit") || streq(command, "q"))
 		safe_exit(EXIT_SUCCESS);
-	parse_command_client(STDOUT_FILENO, command, buff);
+	if (streq(command, "set")) {
+		parse_command_set(buff);
+		return;
+	}
+	if (streq(command, "queues")) {
+		print_queues();
+		return;
+	}
+	if (streq(command, "trace")) {
+		parse_command_trace(buff);
+		return;
+	}
+	if (streq(command, "stats") && strstr(buff, "reset")) {
+		stats::reset();
+		printf("stats reset\n");
+		return;
+	}
+	parse_command_client(make_shared<const Request>(Request{console}), command, buff);
+}
+
+
+// prints the stats every interval seconds (--stats-interval)
+void *stats_routine(void *arg) {
+	const auto interval = (unsigned) (intptr_t) arg;
+	while (true) {
+		sleep(interval);
+		printf("---- stats ----\n%s", stats::report().c_str());
+		fflush(stdout);
+	}
+}
+
+
+// reactor of the calling I/O thread
+thread_local void *io_reactor = nullptr;
+// a connection served by an I/O thread, and the requests it is sending
+struct ClientSession {
+	ConnectionRef connection;
+	proto::RequestReader reader;
+	// counts towards --max-connections
+	bool admitted = false;
+};
+
+// sessions of the calling I/O thread, by fd
+thread_local vector<ClientSession> io_clients;
+
+ClientSession &io_client(const fd_t fd) {
+	if ((size_t) fd >= io_clients.size()) io_clients.resize(fd + 1);
+	return io_clients[fd];
+}
+
+void close_client(const fd_t client_fd) {
+	reactor::removeFdFromReactor(io_reactor, client_fd);
+	// close client fd, stop tracking it
+	auto &session = io_client(client_fd);
+	if (session.connection) session.connection->close();
+	if (session.admitted) admission::releaseConnection();
+	session = {};
 }
 
+// compute is handed to the job handlers
+void handle_request(const ConnectionRef &client, proto::Request &&request) {
+	LOGI("[client %d] request %u: %.*s", client->fd, request.id,
+	     (int) min(request.text.find('\n'), request.text.size()), request.text.c_str());
+
+	char command[256 + 1];
+	if (sscanf(request.text.c_str(), "%256s", command) == EOF) {
+		LOGW("[client %d] request %u: empty command", client->fd, request.id);
+		return;
+	}
 
-void *handle_client(const fd_t client_fd) {
-	// track client fd
-	client_fds.push_back(client_fd);
-	printf("new client connected on fd %d\n", client_fd);
+	// parse command
+	lower(command);
+	parse_command_client(make_shared<const Request>(Request{client, request.id, request.framed}),
+	                     command, request.text.c_str());
+}
 
-	char buff[256 + 1];
+// feeds read bytes to the client's session and handles every complete request ;
+// returns -1 if the client broke the protocol.
+int feed_session(ClientSession &session, const char *data, const size_t len) {
+	session.reader.feed(data, len);
+	proto::Request request;
+	int result;
+	while ((result = session.reader.next(request)) > 0)
+		handle_request(session.connection, std::move(request));
+	if (result < 0) {
+		LOGW("client %d: protocol error", session.connection->fd);
+		return -1;
+	}
+	return 0;
+}
+
+// edge triggered, reads until the socket is drained or the client's output backs up
+void *on_client_readable(const fd_t client_fd) {
+	const auto client = io_client(client_fd).connection;
+	if (!client) return nullptr;
+	// also woken by EPOLLERR, zerocopy completions wait on the error queue
+	client->reapZerocopy();
 
 	while (true) {
-		pollfd pfd = {.fd = client_fd, .events = POLLIN, .revents = POLLIN};
-		// poll for input (cancellation point)
-		if (poll(&pfd, 1, -1) == -1) {
-			perror("poll");
-			continue;
+		if (client->congested()) {
+			// resumed by on_client_writable once the client reads its answers
+			client->reading_paused = true;
+			return nullptr;
 		}
-		if (!(pfd.revents & POLLIN)) continue;
 
-		const ssize_t rn = read(client_fd, buff, 256);
+		char buff[4096];
+		const ssize_t rn = recv(client_fd, buff, sizeof(buff), MSG_DONTWAIT);
+		if (rn < 0 && errno == EINTR) continue;
+		if (rn < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return nullptr;
 
 		if (rn <= 0) {
-			if (rn == 0) printf("socket %d hung up\n", client_fd);
-			else perror("read");
+			if (rn == 0) LOGI("socket %d hung up", client_fd);
+			else LOGE("read from socket %d: %s", client_fd, strerror(errno));
 
 			// client disconnected
+			close_client(client_fd);
+			return nullptr;
+		}
 
-			pthread_mutex_lock(&fds_modify_mutex);
+		if (feed_session(io_client(client_fd), buff, rn) < 0) {
+			close_client(client_fd);
+			return nullptr;
+		}
+	}
+}
 
-			// close client fd
-			close(client_fd);
-			// stop tracking client fd
-			erase(client_fds, client_fd);
+// socket took what it had queued, flush the rest
+void *on_client_writable(const fd_t client_fd) {
+	const auto client = io_client(client_fd).connection;
+	if (!client) return nullptr;
 
-			pthread_mutex_unlock(&fds_modify_mutex);
+	if (client->flush() < 0) {
+		close_client(client_fd);
+		return nullptr;
+	}
+	if (client->reading_paused && client->drained()) {
+		client->reading_paused = false;
+		on_client_readable(client_fd);
+	}
+	return nullptr;
+}
 
-			// return and terminate thread
-			return nullptr;
+// uring proactor completion, the proactor owns accepting and closing its clients
+void on_client_data(const fd_t client_fd, const char *data, const size_t len) {
+	auto &session = io_client(client_fd);
+	if (len > 0) {
+		if (!session.connection) {
+			// the proactor accepts on its own, clients are admitted on their first data
+			session.connection = make_shared<reactor::Connection>(client_fd);
+			// replies that outlive this client must not reach the next one on client_fd
+			session.connection->uring_generation = proactor::uringGeneration(client_fd);
+			session.admitted = admission::admitConnection();
+			if (!session.admitted) {
+				LOGW("refusing client on fd %d: too many connections", client_fd);
+				session.connection->close(false);
+				shutdown(client_fd, SHUT_RDWR);
+			}
 		}
+		// a broken or refused stream is ignored from then on, the proactor keeps the fd until hangup
+		if (session.connection->isClosed()) return;
+		if (feed_session(session, data, len) < 0) session.connection->close(false);
+		return;
+	}
+	LOGI("socket %d hung up", client_fd);
+	if (session.connection) session.connection->close(false);
+	if (session.admitted) admission::releaseConnection();
+	session = {};
+}
 
+void *on_accept(const fd_t listen_fd) {
+	// accept everything pending, the listening socket is non-blocking
+	while (true) {
+		const fd_t client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOGE("accept failed: %s", strerror(errno));
+			return nullptr;
+		}
 
-		buff[rn] = '\0';
-		printf("[client %d] %s", client_fd, buff);
-
-		char command[256 + 1];
-		if (sscanf(buff, "%256s", command) == EOF) {
-			perror("failed to read command");
+		if (!admission::admitConnection()) {
+			LOGW("refusing client on fd %d: too many connections", client_fd);
+			close(client_fd);
 			continue;
 		}
 
-		// parse command
-		lower(command);
-		parse_command_client(client_fd, command, buff);
-
-		// cancellation point
-		usleep(1000);
+		// track client
+		io_client(client_fd) = {make_shared<reactor::Connection>(client_fd), {}, true};
+		LOGI("new client connected on fd %d", client_fd);
+		// answers go out as several small frames, don't hold them for acks
+		setNoDelay(client_fd);
+		// large answers are sent without copying them into the socket buffer
+		io_client(client_fd).connection->enableZerocopy();
+
+		if (reactor::addFdToReactor(io_reactor, client_fd, on_client_readable, on_client_writable) != 0)
+			close_client(client_fd);
+		else // edge triggered, anything sent before registering is read now
+			on_client_readable(client_fd);
 	}
 }
 
+// only wakes the I/O thread to see io_running dropped
+void *on_io_stop(const fd_t) { return nullptr; }
+
+void *io_routine(void *arg) {
+	const auto listen_fd = (fd_t) (intptr_t) arg;
+	pthread_setname_np(pthread_self(), "io");
+
+	io_reactor = reactor::startReactor();
+	if (io_reactor == nullptr) return nullptr;
+	reactor::addFdToReactor(io_reactor, listen_fd, on_accept);
+	reactor::addFdToReactor(io_reactor, io_stop_fd, on_io_stop);
+
+	while (io_running)
+		reactor::pollReactor(io_reactor);
+
+	// close all clients
+	for (const auto &session: io_clients)
+		if (session.connection) {
+			LOGI("closing fd %d", session.connection->fd);
+			session.connection->close();
+			if (session.admitted) admission::releaseConnection();
+		}
+	io_clients.clear();
+	reactor::stopReactor(io_reactor);
+	return nullptr;
+}
+
 void handle_input() {
 	string buff;
+	// stdin speaks the text protocol, a graph spans several lines
+	proto::RequestReader reader;
 
 	while (true) {
-		// read input
-		getline(cin, buff);
-
-		char command[256 + 1];
-		if (sscanf(buff.c_str(), "%256s", command) == EOF) {
-			perror("failed to read command");
+		// read input, stdin closing leaves the server to signals
+		if (!getline(cin, buff)) {
+			pause();
 			continue;
 		}
+		buff += '\n';
+		reader.feed(buff.data(), buff.size());
+
+		proto::Request request;
+		while (reader.next(request) > 0) {
+			char command[256 + 1];
+			if (sscanf(request.text.c_str(), "%256s", command) == EOF) {
+				perror("failed to read command");
+				continue;
+			}
 
-		// parse command
-		lower(command);
-		parse_command_stdin(command, buff.c_str());
+			// parse command
+			lower(command);
+			parse_command_stdin(command, request.text.c_str());
+		}
 	}
 }
 
 
+// non-blocking listening socket. sockets of all I/O threads share the port,
+// the kernel spreads new connections between them.
+// --backlog: pending connections the kernel queues per listening socket
+int listen_backlog = SOMAXCONN;
+
 fd_t setup_server() {
 	sockaddr_in server_addr{};
 
-	const fd_t server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	const fd_t server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (server_fd < 0) {
 		perror("socket");
 		safe_exit(EXIT_FAILURE);
@@ -302,6 +885,7 @@ fd_t setup_server() {
 
 	constexpr int yes = 1;
 	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+	setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
 
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_addr.s_addr = INADDR_ANY;
@@ -312,7 +896,7 @@ fd_t setup_server() {
 		safe_exit(EXIT_FAILURE);
 	}
 
-	if (listen(server_fd, 3) < 0) {
+	if (listen(server_fd, listen_backlog) < 0) {
 		perror("listen");
 		safe_exit(EXIT_FAILURE);
 	}
@@ -320,31 +904,248 @@ fd_t setup_server() {
 	return server_fd;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+	const int cores = (int) max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+	int min_threads = 2, max_threads = cores;
+	int io_thread_count = cores;
+	bool pin_threads = false;
+	string io_backend = "epoll";
+	size_t stage_capacity = 64;
+	// threads per pipeline stage, mc is the slowest and scales out by default
+	vector stage_widths(graph_pipeline_stage_names.size(), 1);
+	stage_widths[0] = max(1, cores / 2);
+	vector<int> io_cpus;
+	int stats_interval = 0;
+	const option longopts[] = {
+		{"threads-min", required_argument, nullptr, 'm'},
+		{"threads-max", required_argument, nullptr, 'M'},
+		{"affinity", no_argument, nullptr, 'a'},
+		{"io-cpus", required_argument, nullptr, 'i'},
+		{"io-threads", required_argument, nullptr, 't'},
+		{"io", required_argument, nullptr, 'I'},
+		{"stage-capacity", required_argument, nullptr, 'c'},
+		{"stage-workers", required_argument, nullptr, 'w'},
+		{"stats-interval", required_argument, nullptr, 's'},
+		{"trace", no_argument, nullptr, 'T'},
+		{"backlog", required_argument, nullptr, 'b'},
+		{"max-connections", required_argument, nullptr, 'C'},
+		{"max-queued", required_argument, nullptr, 'q'},
+		{"latency-budget", required_argument, nullptr, 'L'},
+		{"cost-model", required_argument, nullptr, 'X'},
+		{"inline-below", required_argument, nullptr, 'N'},
+		{"bulk-above", required_argument, nullptr, 'U'},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0}
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "m:M:ai:t:I:c:w:s:Tb:C:q:L:X:N:U:h", longopts, nullptr)) != -1) {
+		switch (opt) {
+			case 'm':
+				min_threads = atoi(optarg);
+				break;
+			case 'M':
+				max_threads = atoi(optarg);
+				break;
+			case 'a':
+				pin_threads = true;
+				break;
+			case 'i':
+				io_cpus = cpu::parseCpuList(optarg);
+				pin_threads = true;
+				break;
+			case 't':
+				io_thread_count = max(1, atoi(optarg));
+				break;
+			case 'I':
+				io_backend = optarg;
+				if (io_backend != "epoll" && io_backend != "uring") {
+					cerr << "Unknown I/O backend \"" << io_backend << "\"." << endl;
+					return 1;
+				}
+				break;
+			case 'c':
+				stage_capacity = strtoul(optarg, nullptr, 10);
+				break;
+			case 'w': {
+				// <stage>=<n>[,<stage>=<n>...]
+				istringstream in(optarg);
+				string entry;
+				while (getline(in, entry, ',')) {
+					const auto eq = entry.find('=');
+					const auto it = ranges::find(graph_pipeline_stage_names, entry.substr(0, eq));
+					if (eq == string::npos || it == graph_pipeline_stage_names.end()) {
+						cerr << "Unknown stage width \"" << entry << "\"." << endl;
+						return 1;
+					}
+					stage_widths[it - graph_pipeline_stage_names.begin()] = max(1, atoi(entry.c_str() + eq + 1));
+				}
+				break;
+			}
+			case 's':
+				stats_interval = max(0, atoi(optarg));
+				break;
+			case 'T':
+				trace::enable(true);
+				break;
+			case 'b':
+				listen_backlog = max(1, atoi(optarg));
+				break;
+			case 'C':
+				admission::max_connections = max(0, atoi(optarg));
+				break;
+			case 'q':
+				admission::max_queued = strtoul(optarg, nullptr, 10);
+				break;
+			case 'L':
+				admission::budget_ns = (uint64_t) max(0, atoi(optarg)) * 1000000ull;
+				break;
+			case 'X':
+				try {
+					const int lines = executor::model.calibrate(optarg);
+					printf("cost model: %d lines fitted from %s\n", lines, optarg);
+				} catch (const exception &e) {
+					cerr << "Cannot load cost model: " << e.what() << endl;
+					return 1;
+				}
+				break;
+			case 'N':
+				executor::inline_ns = (uint64_t) max(0, atoi(optarg)) * 1000ull;
+				break;
+			case 'U':
+				executor::bulk_ns = (uint64_t) max(0, atoi(optarg)) * 1000000ull;
+				break;
+			case 'h':
+				cout << "Usage: " << argv[0]
+						<< " [--threads-min <n>] [--threads-max <n>] [--affinity] [--io-cpus <list>] [--io-threads <n>]"
+						<< " [--io epoll|uring]"
+						<< " [--stage-capacity <n>] [--stage-workers <stage>=<n>,...] [--stats-interval <s>] [--trace]"
+						<< " [--backlog <n>] [--max-connections <n>] [--max-queued <n>] [--latency-budget <ms>]"
+						<< " [--cost-model <bench.json|csv>] [--inline-below <us>] [--bulk-above <ms>]" << endl;
+				return 0;
+			default:
+				cerr << "Unknown option. Use --help for usage." << endl;
+				return 1;
+		}
+	}
+
 	signal(SIGINT, safe_exit);
+	// threads started below inherit SIGINT blocked, so safe_exit never runs on a thread it joins
+	sigset_t sigint;
+	sigemptyset(&sigint);
+	sigaddset(&sigint, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigint, nullptr);
 
-	// init mutexes
-	pthread_mutex_init(&fds_modify_mutex, nullptr);
+	// a client gone mid-answer shows up as a write error, not a signal
+	signal(SIGPIPE, SIG_IGN);
 
-	// create server socket
-	const fd_t server_socket = setup_server();
+	// request handling logs through the background flusher
+	logging::start();
 
-	// start client job thread manager
-	job_handler.start();
-	// setup client job pipeline
-	graph_pipeline_stages = {
-		pipeline_handler.startActiveObject(graph_pl::workers::alg::mc),
-		pipeline_handler.startActiveObject(graph_pl::workers::alg::eu),
-		pipeline_handler.startActiveObject(graph_pl::workers::alg::mf),
-		pipeline_handler.startActiveObject(graph_pl::workers::alg::sc),
-
-		pipeline_handler.startActiveObject(graph_pl::workers::send_results)
+	const vector stage_workers = {
+		graph_pl::workers::alg::mc,
+		graph_pl::workers::alg::eu,
+		graph_pl::workers::alg::mf,
+		graph_pl::workers::alg::sc,
+
+		graph_pl::workers::send_results
 	};
 
-	// start server client connection proactor
-	client_connection_proactor = proactor::startProactor(server_socket, handle_client);
+	// optional thread placement: I/O cpus, a core per stage worker, workers by cache group
+	cpu::Placement placement;
+	if (pin_threads) {
+		// fused stages run on their callers and need no cores
+		vector<int> pinned_widths;
+		for (size_t s = 0; s < stage_workers.size(); s++)
+			pinned_widths.push_back(stage_workers[s] == graph_pl::workers::send_results ? 0 : stage_widths[s]);
+		placement = cpu::plan(io_cpus, io_thread_count, pinned_widths);
+		// no usable cpus found, run unpinned
+		if (placement.stages.size() < stage_workers.size()) {
+			fprintf(stderr, "no cpu topology found, threads are not pinned\n");
+			pin_threads = false;
+		} else {
+			job_handler.setAffinity(placement.workers);
+			// I/O threads beyond their cpus would only share them
+			const int io_cpu_count = CPU_COUNT(&placement.io);
+			if (io_thread_count > io_cpu_count)
+				printf("%d I/O threads cut to %d, one per I/O cpu\n", io_thread_count, io_cpu_count);
+			io_thread_count = min(io_thread_count, io_cpu_count);
+			printf("pinning %d I/O threads to %d cpus\n", io_thread_count, io_cpu_count);
+		}
+	}
+
+	// create server sockets, one per I/O thread
+	for (int t = 0; t < io_thread_count; t++)
+		listen_fds.push_back(setup_server());
+	io_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	// start client job thread manager, grows with load up to max
+	job_handler.resize(min_threads, max_threads);
+	job_handler.start();
+	// long graphs get half the cores, so they can't take all of them from everything else
+	bulk_handler.resize(1, max(1, cores / 2));
+	bulk_handler.start();
+	// setup client job pipeline, full stages turn new jobs away.
+	// send_results sends each request's answers in one go, so they never interleave,
+	// and is fused so the last algorithm to finish sends right away.
+	for (size_t s = 0; s < stage_workers.size(); s++)
+		graph_pipeline_stages.push_back(pipeline_handler.startActiveObject(stage_workers[s], {
+			.capacity = stage_capacity,
+			.overflow = pl::Overflow::Reject,
+			.cpus = pin_threads ? &placement.stages[s] : nullptr,
+			.workers = stage_widths[s],
+			.fused = stage_workers[s] == graph_pl::workers::send_results
+		}));
+	graph_route = graph_pl::GraphAlgoPipeline::makeRoute({
+		{graph_pipeline_stages.begin(), graph_pipeline_stages.begin() + SLOT_COUNT},
+		{graph_pipeline_stages[SLOT_COUNT]}
+	});
+
+	// start io_uring proactors if asked for, epoll reactor threads otherwise
+	if (io_backend == "uring") {
+		for (const auto listen_fd: listen_fds) {
+			const auto p = proactor::startUringProactor(listen_fd, on_client_data, pin_threads ? &placement.io : nullptr);
+			if (p == nullptr) break;
+			uring_proactors.push_back(p);
+		}
+		if (uring_proactors.size() == listen_fds.size()) {
+			uring_io = true;
+			printf("started %zu io_uring proactors on port 9034\n", uring_proactors.size());
+		} else {
+			printf("io_uring unavailable, falling back to epoll\n");
+			for (const auto p: uring_proactors)
+				proactor::stopUringProactor(p);
+			uring_proactors.clear();
+		}
+	}
+
+	// start server I/O threads
+	if (!uring_io) {
+		io_running = true;
+		for (const auto listen_fd: listen_fds) {
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			if (pin_threads) pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &placement.io);
+			pthread_t thread;
+			const int err = pthread_create(&thread, &attr, io_routine, (void *) (intptr_t) listen_fd);
+			pthread_attr_destroy(&attr);
+			if (err != 0) {
+				perror("io thread pthread_create");
+				safe_exit(EXIT_FAILURE);
+			}
+			io_threads.push_back(thread);
+		}
+		printf("started %zu I/O threads on port 9034\n", io_threads.size());
+	}
+
+	if (stats_interval > 0) {
+		pthread_t thread;
+		if (pthread_create(&thread, nullptr, stats_routine, (void *) (intptr_t) stats_interval) == 0)
+			pthread_detach(thread);
+		else perror("stats thread pthread_create");
+	}
 
-	// main thread handles std input
+	// main thread handles std input and signals
+	pthread_sigmask(SIG_UNBLOCK, &sigint, nullptr);
 	handle_input();
 
 	safe_exit(EXIT_SUCCESS);
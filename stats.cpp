@@ -0,0 +1,166 @@
+//
+// Server metrics: named counters and latency histograms, recorded per thread and merged on read.
+//
+
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <pthread.h>
+#include <vector>
+
+#include "histogram.hpp"
+
+namespace stats {
+	namespace {
+		// metrics of one thread, locked by the thread on every record and by readers
+		struct ThreadStats {
+			pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+			std::vector<uint64_t> counters;
+			// allocated on first record, most threads only touch a few
+			std::vector<std::unique_ptr<hdr::Histogram> > histograms;
+
+			void merge(const ThreadStats &other) {
+				if (counters.size() < other.counters.size()) counters.resize(other.counters.size());
+				for (size_t i = 0; i < other.counters.size(); i++) counters[i] += other.counters[i];
+				if (histograms.size() < other.histograms.size()) histograms.resize(other.histograms.size());
+				for (size_t i = 0; i < other.histograms.size(); i++) {
+					if (!other.histograms[i]) continue;
+					if (!histograms[i]) histograms[i] = std::make_unique<hdr::Histogram>();
+					histograms[i]->merge(*other.histograms[i]);
+				}
+			}
+		};
+
+		struct Registry {
+			pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+			std::vector<std::string> counter_names, histogram_names;
+			std::vector<ThreadStats *> threads;
+			// what exited threads recorded
+			ThreadStats retired;
+		};
+
+		// never destroyed, threads may still record while the process exits
+		Registry &registry() {
+			static auto *r = new Registry();
+			return *r;
+		}
+
+		int registerName(std::vector<std::string> &names, const std::string &name) {
+			auto &r = registry();
+			pthread_mutex_lock(&r.mutex);
+			auto it = std::find(names.begin(), names.end(), name);
+			if (it == names.end()) it = names.insert(names.end(), name);
+			const int id = (int) (it - names.begin());
+			pthread_mutex_unlock(&r.mutex);
+			return id;
+		}
+
+		// the calling thread's stats, registered on first use and folded into the
+		// retired totals when the thread exits
+		struct ThreadSlot {
+			ThreadStats *stats = nullptr;
+
+			ThreadStats &get() {
+				if (stats) return *stats;
+				stats = new ThreadStats();
+				auto &r = registry();
+				pthread_mutex_lock(&r.mutex);
+				r.threads.push_back(stats);
+				pthread_mutex_unlock(&r.mutex);
+				return *stats;
+			}
+
+			~ThreadSlot() {
+				if (!stats) return;
+				auto &r = registry();
+				pthread_mutex_lock(&r.mutex);
+				std::erase(r.threads, stats);
+				r.retired.merge(*stats);
+				pthread_mutex_unlock(&r.mutex);
+				pthread_mutex_destroy(&stats->mutex);
+				delete stats;
+			}
+		};
+
+		thread_local ThreadSlot slot;
+	}
+
+	int counter(const std::string &name) { return registerName(registry().counter_names, name); }
+
+	int histogram(const std::string &name) { return registerName(registry().histogram_names, name); }
+
+	void add(const int counter, const uint64_t n) {
+		if (counter < 0) return;
+		auto &local = slot.get();
+		pthread_mutex_lock(&local.mutex);
+		if ((size_t) counter >= local.counters.size()) local.counters.resize(counter + 1);
+		local.counters[counter] += n;
+		pthread_mutex_unlock(&local.mutex);
+	}
+
+	void record(const int histogram, const uint64_t ns) {
+		if (histogram < 0) return;
+		auto &local = slot.get();
+		pthread_mutex_lock(&local.mutex);
+		if ((size_t) histogram >= local.histograms.size()) local.histograms.resize(histogram + 1);
+		auto &h = local.histograms[histogram];
+		if (!h) h = std::make_unique<hdr::Histogram>();
+		h->record(ns);
+		pthread_mutex_unlock(&local.mutex);
+	}
+
+	std::string report(const std::string &prefix) {
+		auto &r = registry();
+		ThreadStats merged;
+		pthread_mutex_lock(&r.mutex);
+		merged.merge(r.retired);
+		for (const auto t: r.threads) {
+			pthread_mutex_lock(&t->mutex);
+			merged.merge(*t);
+			pthread_mutex_unlock(&t->mutex);
+		}
+		const auto counter_names = r.counter_names;
+		const auto histogram_names = r.histogram_names;
+		pthread_mutex_unlock(&r.mutex);
+
+		std::string out;
+		char line[256];
+		for (size_t i = 0; i < counter_names.size(); i++) {
+			if (!counter_names[i].starts_with(prefix)) continue;
+			snprintf(line, sizeof(line), "%-36s %lu\n", counter_names[i].c_str(),
+			         i < merged.counters.size() ? merged.counters[i] : 0);
+			out += line;
+		}
+		snprintf(line, sizeof(line), "%-36s %10s %10s %10s %10s %10s %10s %10s (us)\n",
+		         "latency", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+		out += line;
+		for (size_t i = 0; i < histogram_names.size(); i++) {
+			if (!histogram_names[i].starts_with(prefix)) continue;
+			if (i >= merged.histograms.size() || !merged.histograms[i] || merged.histograms[i]->count() == 0)
+				continue;
+			const auto &h = *merged.histograms[i];
+			snprintf(line, sizeof(line), "%-36s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			         histogram_names[i].c_str(), h.count(), h.mean() / 1e3, h.percentile(50) / 1e3,
+			         h.percentile(90) / 1e3, h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.max() / 1e3);
+			out += line;
+		}
+		return out;
+	}
+
+	void reset() {
+		auto &r = registry();
+		pthread_mutex_lock(&r.mutex);
+		r.retired.counters.clear();
+		r.retired.histograms.clear();
+		for (const auto t: r.threads) {
+			pthread_mutex_lock(&t->mutex);
+			std::fill(t->counters.begin(), t->counters.end(), 0);
+			for (auto &h: t->histograms)
+				if (h) h->reset();
+			pthread_mutex_unlock(&t->mutex);
+		}
+		pthread_mutex_unlock(&r.mutex);
+	}
+}
@@ -0,0 +1,49 @@
+//
+// Server metrics: named counters and latency histograms, recorded per thread and merged on read.
+//
+
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <cstdint>
+#include <string>
+
+#include "PthTools.hpp"
+
+namespace stats {
+	// Metrics are registered by name up front (registering an existing name returns its id)
+	// and recorded by id. Each thread records into its own counters and histograms behind
+	// an uncontended lock, readers merge all threads. Totals of exited threads are kept.
+	int counter(const std::string &name);
+
+	// histogram of durations in nanoseconds
+	int histogram(const std::string &name);
+
+	void add(int counter, uint64_t n = 1);
+
+	void record(int histogram, uint64_t ns);
+
+	// metrics merged over threads, one per line: counters, then histograms in microseconds.
+	// Only names starting with prefix if given.
+	std::string report(const std::string &prefix = "");
+
+	// zeroes all metrics
+	void reset();
+
+	// records the time from construction to destruction
+	class Timer {
+		const int histogram;
+		const uint64_t start = now_ns();
+
+	public:
+		explicit Timer(const int histogram) : histogram(histogram) {}
+
+		~Timer() { record(histogram, now_ns() - start); }
+
+		Timer(const Timer &) = delete;
+
+		Timer &operator=(const Timer &) = delete;
+	};
+}
+
+#endif
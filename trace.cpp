@@ -0,0 +1,184 @@
+//
+// Request tracing: spans kept in per-thread ring buffers, dumped as Chrome trace JSON.
+//
+
+#include "trace.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/syscall.h>
+
+namespace trace {
+	std::atomic<bool> tracing = false;
+
+	namespace {
+		std::atomic<uint64_t> next_id = 1;
+
+		enum Kind : uint64_t { COMPLETE, ASYNC };
+
+		// One ring slot under a seqlock: odd while the owner writes it, a reader keeps what
+		// it copied only if the sequence was even and unchanged around the copy.
+		struct Event {
+			std::atomic<uint64_t> seq = 0;
+			std::atomic<uint64_t> id = 0, start = 0, end = 0, kind = 0;
+			std::atomic<const char *> category = nullptr, name = nullptr;
+		};
+
+		// slots per thread, a power of two
+		constexpr size_t ring_size = 8192;
+
+		struct Ring {
+			std::vector<Event> events = std::vector<Event>(ring_size);
+			// events ever written, only stored by the owning thread
+			std::atomic<uint64_t> head = 0;
+			long tid = 0;
+			char thread_name[16] = "";
+		};
+
+		struct Registry {
+			pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+			std::vector<Ring *> rings;
+			// rings of exited threads, reused by new threads (their spans stay dumpable until then)
+			std::vector<Ring *> free_rings;
+		};
+
+		// never destroyed, threads may still record while the process exits
+		Registry &registry() {
+			static auto *r = new Registry();
+			return *r;
+		}
+
+		struct ThreadRing {
+			Ring *ring = nullptr;
+
+			Ring &get() {
+				if (ring) return *ring;
+				char name[16] = "";
+				pthread_getname_np(pthread_self(), name, sizeof(name));
+				auto &r = registry();
+				pthread_mutex_lock(&r.mutex);
+				if (!r.free_rings.empty()) {
+					ring = r.free_rings.back();
+					r.free_rings.pop_back();
+				} else {
+					ring = new Ring();
+					r.rings.push_back(ring);
+				}
+				// dumps read these under the registry lock
+				ring->tid = syscall(SYS_gettid);
+				memcpy(ring->thread_name, name, sizeof(name));
+				pthread_mutex_unlock(&r.mutex);
+				return *ring;
+			}
+
+			~ThreadRing() {
+				if (!ring) return;
+				auto &r = registry();
+				pthread_mutex_lock(&r.mutex);
+				r.free_rings.push_back(ring);
+				pthread_mutex_unlock(&r.mutex);
+			}
+		};
+
+		thread_local ThreadRing thread_ring;
+
+		void append(const Kind kind, const uint64_t id, const char *category, const char *name,
+		            const uint64_t start_ns, const uint64_t end_ns) {
+			if (!enabled() || id == 0) return;
+			auto &ring = thread_ring.get();
+			const uint64_t n = ring.head.load(std::memory_order_relaxed);
+			auto &e = ring.events[n & (ring_size - 1)];
+			const uint64_t seq = e.seq.load(std::memory_order_relaxed);
+			e.seq.store(seq + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			e.id.store(id, std::memory_order_relaxed);
+			e.start.store(start_ns, std::memory_order_relaxed);
+			e.end.store(end_ns, std::memory_order_relaxed);
+			e.kind.store(kind, std::memory_order_relaxed);
+			e.category.store(category, std::memory_order_relaxed);
+			e.name.store(name, std::memory_order_relaxed);
+			e.seq.store(seq + 2, std::memory_order_release);
+			ring.head.store(n + 1, std::memory_order_release);
+		}
+
+		// copy of a slot, false if the owner was writing it
+		struct Copy {
+			uint64_t id, start, end, kind;
+			const char *category, *name;
+		};
+
+		bool read(const Event &e, Copy &out) {
+			const uint64_t seq = e.seq.load(std::memory_order_acquire);
+			if (seq & 1) return false;
+			out = {e.id.load(std::memory_order_relaxed), e.start.load(std::memory_order_relaxed),
+			       e.end.load(std::memory_order_relaxed), e.kind.load(std::memory_order_relaxed),
+			       e.category.load(std::memory_order_relaxed), e.name.load(std::memory_order_relaxed)};
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return seq != 0 && e.seq.load(std::memory_order_relaxed) == seq;
+		}
+	}
+
+	void enable(const bool on) { tracing.store(on); }
+
+	uint64_t newId() { return enabled() ? next_id.fetch_add(1, std::memory_order_relaxed) : 0; }
+
+	void span(const uint64_t id, const char *category, const char *name, const uint64_t start_ns,
+	          const uint64_t end_ns) {
+		append(COMPLETE, id, category, name, start_ns, end_ns);
+	}
+
+	void asyncSpan(const uint64_t id, const char *category, const char *name, const uint64_t start_ns,
+	               const uint64_t end_ns) {
+		append(ASYNC, id, category, name, start_ns, end_ns);
+	}
+
+	long dump(const std::string &path) {
+		FILE *out = fopen(path.c_str(), "w");
+		if (!out) {
+			perror("trace dump");
+			return -1;
+		}
+		const long pid = getpid();
+		long count = 0;
+		fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+
+		auto &r = registry();
+		pthread_mutex_lock(&r.mutex);
+		for (const auto ring: r.rings) {
+			if (count) fprintf(out, ",\n");
+			fprintf(out, "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %ld, \"tid\": %ld, "
+			        "\"args\": {\"name\": \"%s\"}}", pid, ring->tid, ring->thread_name);
+			count++;
+
+			const uint64_t head = ring->head.load(std::memory_order_acquire);
+			for (uint64_t n = head > ring_size ? head - ring_size : 0; n < head; n++) {
+				Copy e;
+				if (!read(ring->events[n & (ring_size - 1)], e)) continue;
+				// Chrome trace timestamps are microseconds
+				const double ts = (double) e.start / 1e3, dur = (double) (e.end - e.start) / 1e3;
+				if (e.kind == ASYNC) {
+					fprintf(out, ",\n{\"ph\": \"b\", \"cat\": \"%s\", \"name\": \"%s\", \"id\": %lu, "
+					        "\"pid\": %ld, \"tid\": %ld, \"ts\": %.3f, \"args\": {\"trace_id\": %lu}}",
+					        e.category, e.name, e.id, pid, ring->tid, ts, e.id);
+					fprintf(out, ",\n{\"ph\": \"e\", \"cat\": \"%s\", \"name\": \"%s\", \"id\": %lu, "
+					        "\"pid\": %ld, \"tid\": %ld, \"ts\": %.3f}",
+					        e.category, e.name, e.id, pid, ring->tid, ts + dur);
+					count += 2;
+				} else {
+					fprintf(out, ",\n{\"ph\": \"X\", \"cat\": \"%s\", \"name\": \"%s\", \"pid\": %ld, "
+					        "\"tid\": %ld, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"trace_id\": %lu}}",
+					        e.category, e.name, pid, ring->tid, ts, dur, e.id);
+					count++;
+				}
+			}
+		}
+		pthread_mutex_unlock(&r.mutex);
+
+		fprintf(out, "\n]}\n");
+		fclose(out);
+		return count;
+	}
+}
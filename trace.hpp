@@ -0,0 +1,56 @@
+//
+// Request tracing: spans kept in per-thread ring buffers, dumped as Chrome trace JSON.
+//
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "PthTools.hpp"
+
+namespace trace {
+	// Each thread appends spans to its own lock-free ring (the oldest are overwritten), a
+	// dump reads all rings without stopping writers. Names and categories must be string
+	// literals or otherwise outlive the trace. Recording is a no-op while tracing is off.
+	extern std::atomic<bool> tracing;
+
+	inline bool enabled() { return tracing.load(std::memory_order_relaxed); }
+
+	void enable(bool on);
+
+	// a new request id, 0 while tracing is off
+	uint64_t newId();
+
+	// a span of work for request id on the calling thread
+	void span(uint64_t id, const char *category, const char *name, uint64_t start_ns, uint64_t end_ns);
+
+	// a span of request id not tied to a thread (waits, a request's whole life), drawn on its own
+	// track per request
+	void asyncSpan(uint64_t id, const char *category, const char *name, uint64_t start_ns, uint64_t end_ns);
+
+	// writes the recorded spans to path as Chrome trace JSON (chrome://tracing, ui.perfetto.dev) ;
+	// returns the number of events written, -1 if path can't be written.
+	long dump(const std::string &path);
+
+	// records a span from construction to destruction
+	class Span {
+		const uint64_t id;
+		const char *const category, *const name;
+		const uint64_t start;
+
+	public:
+		Span(const uint64_t id, const char *category, const char *name)
+			: id(id), category(category), name(name), start(id ? now_ns() : 0) {}
+
+		~Span() { if (id) span(id, category, name, start, now_ns()); }
+
+		Span(const Span &) = delete;
+
+		Span &operator=(const Span &) = delete;
+	};
+}
+
+#endif
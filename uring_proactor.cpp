@@ -0,0 +1,548 @@
+//
+// io_uring proactor, talks to the kernel with raw syscalls (no liburing).
+//
+
+#include "fd_polling.hpp"
+
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <vector>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "connection.hpp"
+#include "logger.hpp"
+
+
+namespace proactor {
+	static int io_uring_setup(const unsigned entries, io_uring_params *params) {
+		return (int) syscall(__NR_io_uring_setup, entries, params);
+	}
+
+	static int io_uring_enter(const fd_t ring_fd, const unsigned to_submit, const unsigned min_complete,
+	                          const unsigned flags) {
+		return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+	}
+
+	static int io_uring_register(const fd_t ring_fd, const unsigned opcode, void *arg, const unsigned nr_args) {
+		return (int) syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+	}
+
+	// operation of a submission, packed with the connection generation and fd in user_data
+	enum op_kind : uint64_t { ACCEPT = 1, RECV, SEND, WAKE, CANCEL };
+
+	static uint64_t tag(const op_kind kind, const uint32_t generation, const fd_t fd) {
+		return kind << 56 | (uint64_t) (generation & 0xffffff) << 32 | (uint32_t) fd;
+	}
+
+	// generations are unique across proactors, a closed fd may be reused by another one
+	static std::atomic<uint32_t> last_generation = 0;
+
+	struct uring_connection {
+		// new on every accept, tells completions and sends of a previous client on the same fd apart
+		uint32_t generation = 0;
+		// reading and accepting sends
+		bool open = false;
+		// a send of the chain failed, drop what is left
+		bool failed = false;
+		// a multishot read is active
+		bool recv_armed = false;
+		// reading stopped while the client's output is over the high water mark
+		bool paused = false;
+		// bytes queued and in flight
+		size_t pending = 0;
+		// waiting to be sent
+		std::vector<std::string> queued;
+		// sent as one linked chain, kept alive until all of it completed
+		std::vector<std::string> inflight;
+		size_t completed = 0;
+	};
+
+	struct uring_proactor {
+		// submissions and completions in flight
+		static constexpr unsigned ring_entries = 256;
+		// provided read buffers, the ring size must be a power of 2
+		static constexpr unsigned buf_count = 256;
+		static constexpr unsigned buf_size = 4096;
+		static constexpr uint16_t buf_group = 0;
+		// most sends linked in one chain
+		static constexpr size_t max_chain = 16;
+		// output backlog past which a client's reads stop, and below which they resume
+		static constexpr size_t high_water = reactor::Connection::default_high_water;
+		static constexpr size_t low_water = reactor::Connection::default_low_water;
+
+		const fd_t socket;
+		const completionFunc readFunc;
+
+		fd_t ring_fd = -1;
+		void *ring_ptr = MAP_FAILED;
+		size_t ring_size = 0;
+		io_uring_sqe *sqes = (io_uring_sqe *) MAP_FAILED;
+		size_t sqes_size = 0;
+		unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+		unsigned sq_mask = 0, sq_entries = 0, sq_local_tail = 0, to_submit = 0;
+		unsigned *cq_head = nullptr, *cq_tail = nullptr;
+		unsigned cq_mask = 0;
+		io_uring_cqe *cqes = nullptr;
+
+		io_uring_buf_ring *buf_ring = (io_uring_buf_ring *) MAP_FAILED;
+		char *buffers = nullptr;
+		uint16_t buf_tail = 0;
+
+		// wakes the proactor thread for sends queued by other threads and for stop
+		fd_t wake_fd = -1;
+		pthread_mutex_t outbox_mutex = PTHREAD_MUTEX_INITIALIZER;
+		struct outgoing {
+			fd_t fd;
+			uint32_t generation;
+			std::string data;
+		};
+
+		std::vector<outgoing> outbox;
+
+		std::vector<uring_connection> connections;
+		std::atomic<bool> running = false;
+		pthread_t thread{};
+
+		uring_proactor(const fd_t socket, const completionFunc readFunc) : socket(socket), readFunc(readFunc) {}
+
+		~uring_proactor();
+
+		int setup();
+
+		io_uring_sqe *getSqe();
+
+		unsigned sqFree() const { return sq_entries - (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)); }
+
+		int submit(unsigned wait_nr);
+
+		void recycle(uint16_t bid);
+
+		void armAccept();
+
+		void armRecv(fd_t fd);
+
+		void armWake();
+
+		void pauseRecv(fd_t fd);
+
+		void flush(fd_t fd);
+
+		void hangup(fd_t fd);
+
+		void complete(const io_uring_cqe &cqe);
+
+		void drainOutbox();
+
+		void run();
+	};
+
+
+	// uring proactor owning each client fd, looked up by sendUring
+	static std::vector<uring_proactor *> owners;
+	static pthread_mutex_t owners_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+	static void setOwner(const fd_t fd, uring_proactor *proactor) {
+		pthread_mutex_lock(&owners_mutex);
+		if ((size_t) fd >= owners.size()) owners.resize(fd + 1);
+		owners[fd] = proactor;
+		pthread_mutex_unlock(&owners_mutex);
+	}
+
+
+	int uring_proactor::setup() {
+		io_uring_params params{};
+		ring_fd = io_uring_setup(ring_entries, &params);
+		if (ring_fd < 0) {
+			perror("io_uring_setup");
+			return -1;
+		}
+		if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+			fprintf(stderr, "io_uring: kernel lacks single mmap rings\n");
+			return -1;
+		}
+
+		// sq and cq rings share one mapping
+		ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+		                     params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+		ring_ptr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                ring_fd, IORING_OFF_SQ_RING);
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe *) mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                             ring_fd, IORING_OFF_SQES);
+		if (ring_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+			perror("io_uring mmap");
+			return -1;
+		}
+		const auto base = (char *) ring_ptr;
+		sq_head = (unsigned *) (base + params.sq_off.head);
+		sq_tail = (unsigned *) (base + params.sq_off.tail);
+		sq_mask = *(unsigned *) (base + params.sq_off.ring_mask);
+		sq_entries = params.sq_entries;
+		sq_array = (unsigned *) (base + params.sq_off.array);
+		// sqes are used in ring order, the index array is the identity
+		for (unsigned i = 0; i < sq_entries; i++) sq_array[i] = i;
+		sq_local_tail = *sq_tail;
+		cq_head = (unsigned *) (base + params.cq_off.head);
+		cq_tail = (unsigned *) (base + params.cq_off.tail);
+		cq_mask = *(unsigned *) (base + params.cq_off.ring_mask);
+		cqes = (io_uring_cqe *) (base + params.cq_off.cqes);
+
+		// provided buffer ring, the kernel picks a buffer for each read
+		buf_ring = (io_uring_buf_ring *) mmap(nullptr, buf_count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+		                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf_ring == MAP_FAILED) {
+			perror("buffer ring mmap");
+			return -1;
+		}
+		// filled before registering, the kernel pins the pages as they are
+		buffers = new char[buf_count * buf_size];
+		for (unsigned bid = 0; bid < buf_count; bid++)
+			recycle(bid);
+		io_uring_buf_reg reg{};
+		reg.ring_addr = (uint64_t) buf_ring;
+		reg.ring_entries = buf_count;
+		reg.bgid = buf_group;
+		if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+			perror("io_uring register buffer ring");
+			return -1;
+		}
+
+		wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (wake_fd < 0) {
+			perror("eventfd");
+			return -1;
+		}
+
+		armAccept();
+		armWake();
+		return 0;
+	}
+
+	uring_proactor::~uring_proactor() {
+		// closing the ring cancels whatever is still in flight
+		if (ring_fd >= 0) close(ring_fd);
+		if (wake_fd >= 0) close(wake_fd);
+		if (ring_ptr != MAP_FAILED) munmap(ring_ptr, ring_size);
+		if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+		if (buf_ring != MAP_FAILED) munmap(buf_ring, buf_count * sizeof(io_uring_buf));
+		delete[] buffers;
+		pthread_mutex_destroy(&outbox_mutex);
+	}
+
+	io_uring_sqe *uring_proactor::getSqe() {
+		// full, hand what is queued to the kernel first
+		if (sqFree() == 0 && (submit(0) < 0 || sqFree() == 0))
+			return nullptr;
+		const auto sqe = &sqes[sq_local_tail & sq_mask];
+		memset(sqe, 0, sizeof(*sqe));
+		sq_local_tail++;
+		to_submit++;
+		return sqe;
+	}
+
+	int uring_proactor::submit(const unsigned wait_nr) {
+		__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+		const int submitted = io_uring_enter(ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (submitted < 0) {
+			// interrupted, or completions must be reaped before more can be submitted
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) return 0;
+			LOGE("io_uring_enter: %s", strerror(errno));
+			return -1;
+		}
+		to_submit -= submitted;
+		return submitted;
+	}
+
+	void uring_proactor::recycle(const uint16_t bid) {
+		// not buf_ring->bufs, the uapi flex array lands at offset 8 when compiled as C++
+		auto &buf = ((io_uring_buf *) buf_ring)[buf_tail & (buf_count - 1)];
+		buf.addr = (uint64_t) (buffers + (size_t) bid * buf_size);
+		buf.len = buf_size;
+		buf.bid = bid;
+		__atomic_store_n(&buf_ring->tail, ++buf_tail, __ATOMIC_RELEASE);
+	}
+
+	void uring_proactor::armAccept() {
+		const auto sqe = getSqe();
+		if (sqe == nullptr) return;
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = socket;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+		sqe->user_data = tag(ACCEPT, 0, socket);
+	}
+
+	void uring_proactor::armRecv(const fd_t fd) {
+		const auto sqe = getSqe();
+		if (sqe == nullptr) return;
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = buf_group;
+		sqe->user_data = tag(RECV, connections[fd].generation, fd);
+		connections[fd].recv_armed = true;
+	}
+
+	void uring_proactor::pauseRecv(const fd_t fd) {
+		auto &c = connections[fd];
+		c.paused = true;
+		if (!c.recv_armed) return;
+		// the read ends with -ECANCELED, resumed once the client reads its answers
+		const auto sqe = getSqe();
+		if (sqe == nullptr) return;
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = tag(RECV, c.generation, fd);
+		sqe->user_data = tag(CANCEL, c.generation, fd);
+	}
+
+	void uring_proactor::armWake() {
+		const auto sqe = getSqe();
+		if (sqe == nullptr) return;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = wake_fd;
+		sqe->poll32_events = POLLIN;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->user_data = tag(WAKE, 0, wake_fd);
+	}
+
+	void uring_proactor::flush(const fd_t fd) {
+		auto &c = connections[fd];
+		if (!c.open) c.queued.clear();
+		if (!c.inflight.empty() || c.queued.empty()) return;
+
+		// a chain only holds if it is submitted in one go
+		const size_t n = std::min({c.queued.size(), max_chain, (size_t) sq_entries});
+		if (sqFree() < n && submit(0) < 0) return;
+		if (sqFree() < n) return; // retried once earlier sends complete
+
+		c.inflight.assign(std::make_move_iterator(c.queued.begin()), std::make_move_iterator(c.queued.begin() + n));
+		c.queued.erase(c.queued.begin(), c.queued.begin() + n);
+		c.completed = 0;
+		c.failed = false;
+		for (size_t i = 0; i < n; i++) {
+			const auto sqe = getSqe();
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = fd;
+			sqe->addr = (uint64_t) c.inflight[i].data();
+			sqe->len = c.inflight[i].size();
+			// waitall keeps a short send from letting the next link run
+			sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+			if (i + 1 < n) sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = tag(SEND, c.generation, fd);
+		}
+	}
+
+	void uring_proactor::hangup(const fd_t fd) {
+		auto &c = connections[fd];
+		if (!c.open) return;
+		c.open = false;
+		c.queued.clear();
+		setOwner(fd, nullptr);
+		readFunc(fd, nullptr, 0);
+		// sends in flight still use the fd, the last one to complete closes it
+		if (c.inflight.empty()) close(fd);
+	}
+
+	void uring_proactor::complete(const io_uring_cqe &cqe) {
+		const auto kind = (op_kind) (cqe.user_data >> 56);
+		const auto generation = (uint32_t) (cqe.user_data >> 32) & 0xffffff;
+		const auto fd = (fd_t) (cqe.user_data & 0xffffffff);
+		const bool more = cqe.flags & IORING_CQE_F_MORE;
+
+		switch (kind) {
+			case ACCEPT:
+				if (cqe.res >= 0) {
+					const fd_t client_fd = cqe.res;
+					// answers go out as several small frames, don't hold them for acks
+					setNoDelay(client_fd);
+					if ((size_t) client_fd >= connections.size()) connections.resize(client_fd + 1);
+					auto &c = connections[client_fd];
+					// 24 bits are kept in user_data, 0 is never a client
+					do c.generation = ++last_generation & 0xffffff; while (c.generation == 0);
+					c.open = true;
+					c.paused = false;
+					c.pending = 0;
+					setOwner(client_fd, this);
+					armRecv(client_fd);
+				} else LOGE("io_uring accept: %s", strerror(-cqe.res));
+				// unsupported multishot accept would fail forever, do not rearm it
+				if (!more && cqe.res != -EINVAL && running) armAccept();
+				break;
+
+			case RECV: {
+				auto &c = connections[fd];
+				const bool current = c.generation == generation && c.open;
+				if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+					const auto bid = (uint16_t) (cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+					if (current) readFunc(fd, buffers + (size_t) bid * buf_size, cqe.res);
+					recycle(bid);
+				}
+				if (!current || more) break;
+				c.recv_armed = false;
+				// multishot ends when buffers ran out, when paused, or on hangup and errors
+				if (cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -ECANCELED) {
+					if (!c.paused) armRecv(fd);
+				} else hangup(fd);
+				break;
+			}
+
+			case SEND: {
+				auto &c = connections[fd];
+				if (c.generation != generation || c.inflight.empty()) break;
+				if (cqe.res < 0) c.failed = true;
+				if (++c.completed < c.inflight.size()) break;
+				// whole chain is done, its buffers can go
+				for (const auto &data: c.inflight) c.pending -= data.size();
+				c.inflight.clear();
+				if (c.failed) {
+					c.queued.clear();
+					c.pending = 0;
+				}
+				if (!c.open) {
+					close(fd);
+					break;
+				}
+				flush(fd);
+				if (c.paused && c.pending <= low_water) {
+					c.paused = false;
+					if (!c.recv_armed) armRecv(fd);
+				}
+				break;
+			}
+
+			case CANCEL:
+				break;
+
+			case WAKE: {
+				eventfd_t value;
+				eventfd_read(wake_fd, &value);
+				drainOutbox();
+				if (!more && running) armWake();
+				break;
+			}
+		}
+	}
+
+	void uring_proactor::drainOutbox() {
+		std::vector<outgoing> sends;
+		pthread_mutex_lock(&outbox_mutex);
+		sends.swap(outbox);
+		pthread_mutex_unlock(&outbox_mutex);
+
+		// the fd may have been closed and handed to a new client since
+		for (auto &[fd, generation, data]: sends)
+			if ((size_t) fd < connections.size() && connections[fd].open && connections[fd].generation == generation) {
+				connections[fd].pending += data.size();
+				connections[fd].queued.push_back(std::move(data));
+			}
+		for (const auto &send: sends)
+			if ((size_t) send.fd < connections.size()) {
+				flush(send.fd);
+				auto &c = connections[send.fd];
+				if (c.open && !c.paused && c.pending > high_water) pauseRecv(send.fd);
+			}
+	}
+
+	void uring_proactor::run() {
+		while (running) {
+			if (submit(1) < 0) break;
+
+			unsigned head = *cq_head;
+			const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; head++) {
+				// copy out, handling may submit and the kernel may post more
+				const io_uring_cqe cqe = cqes[head & cq_mask];
+				__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+				complete(cqe);
+			}
+		}
+	}
+
+	static void *uring_routine(void *arg) {
+		pthread_setname_np(pthread_self(), "uring");
+		static_cast<uring_proactor *>(arg)->run();
+		return nullptr;
+	}
+
+	void *startUringProactor(const fd_t sock_fd, const completionFunc readFunc, const cpu_set_t *cpus) {
+		const auto proactor = new uring_proactor(sock_fd, readFunc);
+		if (proactor->setup() < 0) {
+			delete proactor;
+			return nullptr;
+		}
+
+		proactor->running = true;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (cpus && CPU_COUNT(cpus) > 0)
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), cpus);
+		const int err = pthread_create(&proactor->thread, &attr, uring_routine, proactor);
+		pthread_attr_destroy(&attr);
+		if (err != 0) {
+			perror("uring proactor pthread_create");
+			delete proactor;
+			return nullptr;
+		}
+		LOGI("started io_uring proactor thread %lu for socket %d", proactor->thread, sock_fd);
+		return proactor;
+	}
+
+	uint32_t uringGeneration(const fd_t fd) {
+		pthread_mutex_lock(&owners_mutex);
+		const auto proactor = (size_t) fd < owners.size() ? owners[fd] : nullptr;
+		pthread_mutex_unlock(&owners_mutex);
+		// connections are only changed by the proactor thread, the caller
+		return proactor && (size_t) fd < proactor->connections.size() ? proactor->connections[fd].generation : 0;
+	}
+
+	int sendUring(const fd_t fd, const uint32_t generation, std::string data) {
+		if (data.empty()) return 0;
+
+		// owners lock keeps the proactor alive while queueing
+		pthread_mutex_lock(&owners_mutex);
+		const auto proactor = (size_t) fd < owners.size() ? owners[fd] : nullptr;
+		if (proactor == nullptr) {
+			pthread_mutex_unlock(&owners_mutex);
+			return -1;
+		}
+		pthread_mutex_lock(&proactor->outbox_mutex);
+		const bool wake = proactor->outbox.empty();
+		proactor->outbox.push_back({fd, generation, std::move(data)});
+		pthread_mutex_unlock(&proactor->outbox_mutex);
+		if (wake) eventfd_write(proactor->wake_fd, 1);
+		pthread_mutex_unlock(&owners_mutex);
+		return 0;
+	}
+
+	int stopUringProactor(void *proactor) {
+		if (proactor == nullptr) return 0;
+		const auto p = static_cast<uring_proactor *>(proactor);
+
+		p->running = false;
+		eventfd_write(p->wake_fd, 1);
+		if (pthread_join(p->thread, nullptr) != 0) {
+			perror("uring proactor join failed");
+			return -1;
+		}
+
+		// forget its clients before it goes
+		pthread_mutex_lock(&owners_mutex);
+		for (auto &owner: owners)
+			if (owner == p) owner = nullptr;
+		pthread_mutex_unlock(&owners_mutex);
+		for (fd_t fd = 0; fd < (fd_t) p->connections.size(); fd++)
+			if (p->connections[fd].open || !p->connections[fd].inflight.empty())
+				close(fd);
+		delete p;
+		return 0;
+	}
+}